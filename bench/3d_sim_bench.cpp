@@ -0,0 +1,403 @@
+#include "../src/include/prototypes.h"
+
+#include <algorithm>
+#include <vector>
+#include <sys/resource.h>
+#include "headless.h"
+
+/* clang-format off */
+
+/* Headless benchmark of the simulation.  Builds a pile of `--bodies N` cubes over a floor of static tiles,
+ * and runs `--frames M` frames of it through the same `ComputeObject`, `Mesh`, camera, culling and render
+ * queue code as the game, into an offscreen framebuffer of a surfaceless EGL context.  Needs no window or
+ * display, so it runs on a headless CI box.  When no GL context can be made, or with `--no-gl`, only the
+ * cpu backend, the camera and the culling run.
+ *
+ * Prints one JSON object with steps per second, frame time percentiles and peak RSS, to stdout or to
+ * `--out FILE`.  Run it from the repository root, the shaders are loaded from src/shader.
+ *
+ *   --bodies N     Dynamic bodies in the pile (default 4096).
+ *   --frames M     Frames timed (default 600), after `--warmup W` frames that are not (default 60).
+ *   --steps K      Physics steps per frame (default 1).
+ *   --cpu          Step the physics with the cpu backend, `--threads N` sets its thread count.
+ *   --no-gl        Do not create a GL context, implies `--cpu`.
+ *   --width W, --height H  Size of the offscreen framebuffer (default 1280x720).
+ *   --verify-broadphase  Instead of timing, step the scenario `--frames` times and check after every step that
+ *                  the hash grid finds the same colliding pairs as the brute-force scan, on the gpu backend
+ *                  also that the grid read back from the gpu matches the cpu one.  Exits 1 on any mismatch,
+ *                  the brute-force scan is O(n^2), so keep `--bodies` small.
+ *   --verify-backends  Instead of timing, step the scenario `--frames` times on both the gpu and the cpu backend
+ *                  and exit 1 when a position or velocity differs by more than `--tolerance T` (default 0.001)
+ *                  after any step.  Needs a GL context. */
+
+typedef struct {
+  Uint bodies;
+  Uint frames;
+  Uint warmup;
+  Uint steps;
+  Uint threads;
+  bool gl;
+  const char *out;
+} BenchOptions;
+
+/* The scenario, the same for every run with the same `bodies`.  A square floor of static unit cubes, and
+ * above it the bodies in a jittered grid of layers, so they fall, land and pile up while being timed. */
+static void build_scenario(Uint bodies, MVector<ComputeData> *out, Uint *first_body, vec3 *center) {
+  const float spacing = 1.5f;
+  Uint side = 1;
+  while ((side * side * side) < bodies) {
+    ++side;
+  }
+  Uint tiles = ((Uint)ceilf(side * spacing) + 2);
+  out->clear();
+  for (Uint z = 0; z < tiles; ++z) {
+    for (Uint x = 0; x < tiles; ++x) {
+      ComputeData cd = {};
+      cd.pos  = {(x - ((tiles - 1) * 0.5f)), 0.0f, (z - ((tiles - 1) * 0.5f))};
+      cd.size = {1.0f, 1.0f, 1.0f};
+      cd.flags[0] |= (1 << STATIC_MESH);
+      out->push_back(cd);
+    }
+  }
+  *first_body = out->size();
+  for (Uint i = 0; i < bodies; ++i) {
+    Uint x = (i % side);
+    Uint z = ((i / side) % side);
+    Uint y = (i / (side * side));
+    /* Knuth's multiplicative hash, so the pile does not come down perfectly stacked. */
+    Uint h = (i * 2654435761u);
+    float jitter = ((((h >> 16) & 0xff) / 255.0f) * 0.2f - 0.1f);
+    ComputeData cd = {};
+    cd.pos  = {(((x - ((side - 1) * 0.5f)) * spacing) + jitter), (2.0f + (y * spacing)), (((z - ((side - 1) * 0.5f)) * spacing) - jitter)};
+    cd.size = {1.0f, 1.0f, 1.0f};
+    out->push_back(cd);
+  }
+  *center = {0.0f, (1.0f + ((side * spacing) * 0.5f)), 0.0f};
+}
+
+/* Circle the pile once every 10 seconds of simulated time, looking at its center. */
+static void orbit_camera(CameraObject *camera, const vec3 &center, float radius, Uint frame) {
+  float angle = (frame * FRAMETIME_S * (6.2831853f / 10.0f));
+  camera->pos = {(center.x + (cosf(angle) * radius)), (center.y + (radius * 0.3f)), (center.z + (sinf(angle) * radius))};
+  camera->vel = {0.0f, 0.0f, 0.0f};
+  /* The view looks along `-direction`, see `update_camera()`. */
+  calculate_yaw_pitch_from_direction(camera, (camera->pos - center));
+  camera->flag.set<CAMERA_ANGLE_CHANGED>();
+}
+
+/* Copy the state every body is in before the next step, gpu bodies are read back first. */
+static void snapshot_bodies(GameObject *game, MVector<ComputeData> *out) {
+  physics_readback(game);
+  MVector<ComputeData> &bodies = physics_data(game);
+  out->resize(bodies.size());
+  for (Uint i = 0; i < bodies.size(); ++i) {
+    (*out)[i] = bodies[i];
+  }
+}
+
+/* Returns the number of broad phase mismatches over `frames` steps, see `verify_broadphase()`.  The grid of a
+ * step is built from the state before it, so that is what both the gpu grid and the scans are checked against. */
+static Uint verify_broadphase_steps(GameObject *game, Uint frames) {
+  float cell_size = grid_cell_size(physics_data(game));
+  MVector<ComputeData> before;
+  BroadphaseGrid gpu_grid;
+  Uint errors = 0;
+  for (Uint frame = 0; frame < frames; ++frame) {
+    snapshot_bodies(game, &before);
+    physics_perform(game, FUSED_OPERATION);
+    if (game->cpu_physics) {
+      errors += verify_broadphase(before, cell_size, GRID_TABLE_SIZE);
+    }
+    else {
+      game->compute.read_grid(&gpu_grid.start, &gpu_grid.bodies);
+      errors += verify_broadphase(before, cell_size, GRID_TABLE_SIZE, &gpu_grid);
+    }
+  }
+  return errors;
+}
+
+/* Returns the number of steps out of `frames` after which the cpu and gpu backend differ by more than
+ * `tolerance`, see `max_compute_error()`.  Both start every step from the gpu state, so the error is that
+ * of one step and does not compound into the chaos of the pile. */
+static Uint verify_backends_steps(GameObject *game, Uint frames, float tolerance) {
+  float worst = 0.0f;
+  Uint failed = 0;
+  for (Uint frame = 0; frame < frames; ++frame) {
+    game->compute.readback();
+    for (Uint i = 0; i < game->compute.data.size(); ++i) {
+      game->cpu_compute.data[i] = game->compute.data[i];
+    }
+    game->cpu_compute.upload();
+    game->compute.perform(FUSED_OPERATION);
+    game->cpu_compute.perform(FUSED_OPERATION);
+    game->compute.readback();
+    game->cpu_compute.readback();
+    float err = max_compute_error(game->compute.data, game->cpu_compute.data);
+    if (err > tolerance) {
+      fprintf(stderr, "backends: step %u differs by %g\n", frame, err);
+      ++failed;
+    }
+    worst = fmaxf(worst, err);
+  }
+  fprintf(stderr, "backends: largest difference %g over %u steps, tolerance %g\n", worst, frames, tolerance);
+  return failed;
+}
+
+/* Everything holding gl objects goes while the context is still current.  Without a context `game` is
+ * left alone, `ComputeObject` frees gl buffers. */
+static void release_bench(GameObject *game, InstancedMesh *cubes, HeadlessContext *hc, bool gl) {
+  if (!gl) {
+    return;
+  }
+  delete cubes;
+  glDeleteProgram(game->shader_program);
+  glDeleteProgram(game->instanced_program);
+  geometry_arena().release();
+  game->frame.release();
+  delete game;
+  release_headless_context(hc);
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  /* Nearest rank. */
+  Uint rank = (Uint)ceil(p * sorted.size());
+  return sorted[(rank ? (rank - 1) : 0)];
+}
+
+static bool write_json(FILE *out, const BenchOptions &opt, Uint tiles, const char *backend, const char *renderer, std::vector<double> times, double total_ms) {
+  std::sort(times.begin(), times.end());
+  double mean = (times.empty() ? 0.0 : (total_ms / times.size()));
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out, "{\n");
+  fprintf(out, "  \"scenario\": {\"bodies\": %u, \"static_bodies\": %u, \"frames\": %u, \"warmup\": %u, \"steps_per_frame\": %u},\n", opt.bodies, tiles, opt.frames, opt.warmup, opt.steps);
+  fprintf(out, "  \"backend\": \"%s\",\n", backend);
+  fprintf(out, "  \"renderer\": \"%s\",\n", renderer);
+  fprintf(out, "  \"steps_per_sec\": %.2f,\n", ((total_ms > 0.0) ? ((double)opt.frames * opt.steps / (total_ms / 1000.0)) : 0.0));
+  fprintf(out, "  \"frame_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p99\": %.4f, \"max\": %.4f},\n", mean, percentile(times, 0.50), percentile(times, 0.99), (times.empty() ? 0.0 : times.back()));
+  /* Kilobytes on linux. */
+  fprintf(out, "  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+  fprintf(out, "}\n");
+  return !ferror(out);
+}
+
+int main(int argc, char **argv) {
+  logger().start();
+  BenchOptions opt = {4096, 600, 60, 1, 0, true, nullptr};
+  bool cpu = false;
+  int width  = 1280;
+  int height = 720;
+  bool verify_grid = false;
+  bool verify_backends = false;
+  float tolerance = 1e-3f;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--bodies") == 0 && (i + 1) < argc) {
+      opt.bodies = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--frames") == 0 && (i + 1) < argc) {
+      opt.frames = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--warmup") == 0 && (i + 1) < argc) {
+      opt.warmup = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--steps") == 0 && (i + 1) < argc) {
+      opt.steps = glm::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--cpu") == 0) {
+      cpu = true;
+    }
+    else if (strcmp(argv[i], "--threads") == 0 && (i + 1) < argc) {
+      opt.threads = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--no-gl") == 0) {
+      opt.gl = false;
+    }
+    else if (strcmp(argv[i], "--width") == 0 && (i + 1) < argc) {
+      width = glm::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--height") == 0 && (i + 1) < argc) {
+      height = glm::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--out") == 0 && (i + 1) < argc) {
+      opt.out = argv[++i];
+    }
+    else if (strcmp(argv[i], "--verify-broadphase") == 0) {
+      verify_grid = true;
+    }
+    else if (strcmp(argv[i], "--verify-backends") == 0) {
+      verify_backends = true;
+    }
+    else if (strcmp(argv[i], "--tolerance") == 0 && (i + 1) < argc) {
+      tolerance = atof(argv[++i]);
+    }
+  }
+  HeadlessContext hc = {EGL_NO_DISPLAY, EGL_NO_CONTEXT, 0, 0, 0};
+  if (opt.gl && !init_headless_context(&hc, width, height)) {
+    LOG_WARN("Running without GL, only the cpu backend, the camera and the culling are timed\n");
+    opt.gl = false;
+  }
+  if (verify_backends && !opt.gl) {
+    fprintf(stderr, "--verify-backends needs a GL context for the gpu backend\n");
+    return 1;
+  }
+  /* The gpu backend is the game's, the cpu one is stepped alongside it. */
+  cpu = ((cpu || !opt.gl) && !verify_backends);
+  /* On the heap, since without a context it can never be destroyed, `ComputeObject` frees gl buffers. */
+  GameObject *game = new GameObject();
+  game->cpu_physics = cpu;
+  game->width  = width;
+  game->height = height;
+  game->camera.sensitivity = 0.07f;
+  Uint first_body = 0;
+  vec3 center;
+  MVector<ComputeData> scenario;
+  build_scenario(opt.bodies, &scenario, &first_body, &center);
+  float radius = (center.y * 3.0f);
+  ThreadPool pool((cpu || verify_backends) ? opt.threads : 1);
+  if (opt.gl) {
+    game->shader_program = create_shader_program({
+      {"src/shader/shader.vert", GL_VERTEX_SHADER},
+      {"src/shader/shader.frag", GL_FRAGMENT_SHADER},
+      }, {}
+    );
+    game->instanced_program = create_shader_program({
+      {"src/shader/instanced.vert", GL_VERTEX_SHADER},
+      {"src/shader/shader.frag",    GL_FRAGMENT_SHADER},
+      }, {}
+    );
+    /* Every program is created before any is finished, like the game does, `ComputeObject::init()` queries its program. */
+    Uint compute_program = (cpu ? 0 : create_comp_shader_program("src/shader/shader.comp"));
+    finish_shader_programs();
+    shader_cache().report(stderr);
+    game->frame.init();
+    if (!cpu) {
+      game->compute.init(compute_program, scenario.size(), true);
+    }
+  }
+  if (cpu || verify_backends) {
+    game->cpu_compute.init(scenario.size(), true);
+    game->cpu_compute.pool = &pool;
+  }
+  for (Uint i = 0; i < scenario.size(); ++i) {
+    physics_data(game)[i] = scenario[i];
+  }
+  physics_upload(game);
+  if (!cpu) {
+    game->compute.init_grid(GRID_TABLE_SIZE, grid_cell_size(game->compute.data));
+  }
+  init_camera(&game->camera);
+  init_projection(game, radiansf(80.0f), ((float)width / height), 0.1f, 200.0f);
+  game->sun.pos = {0.0f, 20.0f, 0.0f};
+  set_sun_light(game, direction_vec(vec3(0.0f), game->sun.pos), {1.0f, 1.0f, 1.0f}, 0.4f);
+  /* The floor tiles are drawn as meshes and the bodies as instances, like the scenery and bodies of the game. */
+  MVector<Mesh> meshes;
+  if (opt.gl) {
+    for (Uint i = 0; i < scenario.size(); ++i) {
+      Mesh mesh(MeshObject::cube_vertices, MeshObject::cube_indices, game->shader_program, ((i < first_body) ? blue_color_vec : red_color_vec));
+      mesh.compute_data(&scenario[i]);
+      meshes.push_back(mesh);
+    }
+    for (auto &mesh : meshes) {
+      add_mesh_to_scene(&game->scene, &mesh);
+    }
+  }
+  InstancedMesh *cubes = (opt.gl ? new InstancedMesh(MeshObject::cube_vertices, MeshObject::cube_indices, game->instanced_program) : nullptr);
+  RenderQueue queue;
+  FrustumCuller culler;
+  if (verify_grid) {
+    Uint errors = verify_broadphase_steps(game, opt.frames);
+    logger().stop();
+    fprintf(stderr, "broadphase: %u mismatches over %u %s steps of %u bodies\n", errors, opt.frames, (cpu ? "cpu" : "gpu"), (Uint)scenario.size());
+    release_bench(game, cubes, &hc, opt.gl);
+    return (errors ? 1 : 0);
+  }
+  if (verify_backends) {
+    Uint failed = verify_backends_steps(game, opt.frames, tolerance);
+    logger().stop();
+    release_bench(game, cubes, &hc, opt.gl);
+    return (failed ? 1 : 0);
+  }
+  std::vector<double> times;
+  times.reserve(opt.frames);
+  double total_ms = 0.0;
+  for (Uint frame = 0; frame < (opt.warmup + opt.frames); ++frame) {
+    time_point frame_start = high_resolution_clock::now();
+    orbit_camera(&game->camera, center, radius, frame);
+    update_camera(&game->camera);
+    if (opt.gl) {
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      update_frame_uniforms(game);
+    }
+    for (Uint s = 0; s < opt.steps; ++s) {
+      physics_perform(game, FUSED_OPERATION);
+    }
+    if (cpu) {
+      game->cpu_compute.readback();
+    }
+    else {
+      /* Draws whatever copy is done, like the game, so the gpu is never waited on mid frame. */
+      game->compute.request_readback(opt.steps);
+      game->compute.poll_readback();
+    }
+    MVector<ComputeData> &bodies = physics_data(game);
+    culler.clear();
+    if (opt.gl) {
+      for (Uint i = first_body; i < meshes.size(); ++i) {
+        meshes[i].compute_data(&bodies[i]);
+        update_mesh_in_scene(&game->scene, &meshes[i]);
+      }
+      for (auto &mesh : meshes) {
+        culler.add(mesh.bounds());
+      }
+    }
+    else {
+      for (const auto &cd : bodies) {
+        culler.add(aabb_from_box(cd.pos, cd.size));
+      }
+    }
+    culler.cull(game->projection * game->camera.view);
+    if (opt.gl) {
+      cubes->clear();
+      for (Uint i : culler.visible_list()) {
+        if (i < first_body) {
+          meshes[i].submit(&queue);
+        }
+        else {
+          cubes->add(meshes[i].pos, meshes[i].rotation, meshes[i]._scale, meshes[i].color);
+        }
+      }
+      cubes->submit(&queue);
+      queue.flush();
+      /* A frame is done when the gpu is, there is no swap to pace it. */
+      glFinish();
+    }
+    double ms = duration<double, std::milli>(high_resolution_clock::now() - frame_start).count();
+    if (frame >= opt.warmup) {
+      times.push_back(ms);
+      total_ms += ms;
+    }
+  }
+  logger().stop();
+  if (cpu) {
+    pool.report(stderr);
+  }
+  else {
+    game->compute.report_readback(stderr);
+  }
+  culler.report(stderr);
+  const char *renderer = (opt.gl ? (const char *)glGetString(GL_RENDERER) : "none");
+  FILE *out = (opt.out ? fopen(opt.out, "w") : stdout);
+  if (!out) {
+    fprintf(stderr, "Failed to open %s\n", opt.out);
+    return 1;
+  }
+  bool ok = write_json(out, opt, first_body, (cpu ? "cpu" : "gpu"), (renderer ? renderer : "unknown"), times, total_ms);
+  if (opt.out) {
+    ok = ((fclose(out) == 0) && ok);
+  }
+  release_bench(game, cubes, &hc, opt.gl);
+  return (ok ? 0 : 1);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+/* clang-format off */
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "../src/include/prototypes.h"
+
+/* An OpenGL context without a window, for the benchmarks.  Uses the surfaceless EGL platform, so it needs
+ * no display server, and renders into a framebuffer of its own. */
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+  #define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+typedef struct {
+  EGLDisplay display;
+  EGLContext context;
+  Uint fbo;
+  Uint color_rb;
+  Uint depth_rb;
+} HeadlessContext;
+
+/* A surfaceless 4.5 core context with a framebuffer of `width` by `height` bound, returns false when the
+ * driver can not give one. */
+inline bool init_headless_context(HeadlessContext *hc, int width, int height) {
+  *hc = {EGL_NO_DISPLAY, EGL_NO_CONTEXT, 0, 0, 0};
+  /* The surfaceless platform needs no gpu device node or display server, the default display is tried
+   * when it is not there. */
+  auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (get_platform_display) {
+    hc->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  }
+  if (hc->display == EGL_NO_DISPLAY) {
+    hc->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  if (hc->display == EGL_NO_DISPLAY || !eglInitialize(hc->display, nullptr, nullptr)) {
+    LOG_WARN("No EGL display\n");
+    return false;
+  }
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    LOG_WARN("EGL can not bind desktop OpenGL\n");
+    eglTerminate(hc->display);
+    return false;
+  }
+  const EGLint config_attribs[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_SURFACE_TYPE, EGL_DONT_CARE, EGL_NONE};
+  EGLConfig config = nullptr;
+  EGLint configs = 0;
+  if (!eglChooseConfig(hc->display, config_attribs, &config, 1, &configs) || !configs) {
+    /* Fine with EGL_KHR_no_config_context, nothing is ever drawn to an EGL surface. */
+    config = nullptr;
+  }
+  const EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 4,
+    EGL_CONTEXT_MINOR_VERSION, 5,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  hc->context = eglCreateContext(hc->display, config, EGL_NO_CONTEXT, context_attribs);
+  if (hc->context == EGL_NO_CONTEXT || !eglMakeCurrent(hc->display, EGL_NO_SURFACE, EGL_NO_SURFACE, hc->context)) {
+    LOG_WARN("No surfaceless OpenGL 4.5 core context: 0x%x\n", eglGetError());
+    if (hc->context != EGL_NO_CONTEXT) {
+      eglDestroyContext(hc->display, hc->context);
+    }
+    eglTerminate(hc->display);
+    hc->context = EGL_NO_CONTEXT;
+    return false;
+  }
+  glewExperimental = GL_TRUE;
+  GLenum err = glewInit();
+  /* A glew built for glx loads the core functions, then fails to find a glx display, which is expected here. */
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+  if (err == GLEW_ERROR_NO_GLX_DISPLAY) {
+    err = GLEW_OK;
+  }
+#endif
+  if (err != GLEW_OK) {
+    LOG_WARN("Failed to initialize glew: %u\n", err);
+    eglMakeCurrent(hc->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(hc->display, hc->context);
+    eglTerminate(hc->display);
+    hc->context = EGL_NO_CONTEXT;
+    return false;
+  }
+  glGenRenderbuffers(1, &hc->color_rb);
+  glBindRenderbuffer(GL_RENDERBUFFER, hc->color_rb);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glGenRenderbuffers(1, &hc->depth_rb);
+  glBindRenderbuffer(GL_RENDERBUFFER, hc->depth_rb);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glGenFramebuffers(1, &hc->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, hc->fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, hc->color_rb);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,  GL_RENDERBUFFER, hc->depth_rb);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    LOG_WARN("Offscreen framebuffer is incomplete\n");
+  }
+  glViewport(0, 0, width, height);
+  glEnable(GL_DEPTH_TEST);
+  return true;
+}
+
+inline void release_headless_context(HeadlessContext *hc) {
+  if (hc->context == EGL_NO_CONTEXT) {
+    return;
+  }
+  glDeleteFramebuffers(1, &hc->fbo);
+  glDeleteRenderbuffers(1, &hc->color_rb);
+  glDeleteRenderbuffers(1, &hc->depth_rb);
+  eglMakeCurrent(hc->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(hc->display, hc->context);
+  eglTerminate(hc->display);
+  hc->context = EGL_NO_CONTEXT;
+}
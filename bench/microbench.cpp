@@ -0,0 +1,382 @@
+#include "headless.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+/* clang-format off */
+
+/* Microbenchmarks of the hot kernels, each on its own over a few input sizes.  Every case is warmed up,
+ * then timed in `--samples` samples that each run long enough to be above the clock resolution, and is
+ * reported as nanoseconds per item (body, vertex, matrix, pair or query), median, mean, deviation, min
+ * and p90.
+ *
+ * The medians are compared against the baseline file, `--baseline FILE`, bench/microbench_baseline.txt by
+ * default.  A case slower than its baseline by more than `--threshold PCT` percent (default 10) is a
+ * regression, and the exit status is then 1.  `--write-baseline` writes this run as the new baseline
+ * instead.  Baselines only mean something on the machine they were written on, so write them on the box
+ * that runs the comparison.  A missing baseline compares nothing and passes, unless `--require-baseline`
+ * is given, then it fails.  The gate in run_bench writes the baseline when there is none, and otherwise
+ * compares with `--require-baseline`, so it only fails on regressions or a baseline it cannot read.
+ *
+ *   --filter TEXT   Only run the cases with TEXT in their name.
+ *   --no-gl         Skip the cases that need a GL context. */
+
+#define MICROBENCH_BASELINE "bench/microbench_baseline.txt"
+
+/* Keeps the compiler from dropping work whose result is never used. */
+template <typename T>
+inline void keep(const T &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+typedef struct {
+  std::string name;
+  Uint samples;
+  /* Nanoseconds per item. */
+  double median;
+  double mean;
+  double stddev;
+  double min;
+  double p90;
+} BenchResult;
+
+class MicroBench {
+ private:
+  typedef std::chrono::high_resolution_clock clock;
+
+  static double elapsed_ns(clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+  }
+
+ public:
+  Uint samples = 25;
+  /* Shortest a sample may be, calls are batched until one takes this long. */
+  double sample_ns = 2e6;
+  double warmup_ns = 5e7;
+  std::string filter;
+  std::vector<BenchResult> results;
+
+  /* Time `fn`, which handles `items` items per call, as case `kernel/size`. */
+  template <typename F>
+  void run(const char *kernel, Uint size, Ulong items, F &&fn) {
+    std::string name = (std::string(kernel) + "/" + std::to_string(size));
+    if (!filter.empty() && name.find(filter) == std::string::npos) {
+      return;
+    }
+    /* Double the batch until a sample is long enough, which also warms the caches, then keep going
+     * until the warmup time is used up. */
+    Ulong calls = 1;
+    double took = 0.0;
+    double warm = 0.0;
+    while (true) {
+      clock::time_point start = clock::now();
+      for (Ulong i = 0; i < calls; ++i) {
+        fn();
+      }
+      took  = elapsed_ns(start);
+      warm += took;
+      if (took >= sample_ns) {
+        break;
+      }
+      calls *= 2;
+    }
+    while (warm < warmup_ns) {
+      clock::time_point start = clock::now();
+      for (Ulong i = 0; i < calls; ++i) {
+        fn();
+      }
+      warm += elapsed_ns(start);
+    }
+    std::vector<double> per_item(samples);
+    for (Uint s = 0; s < samples; ++s) {
+      clock::time_point start = clock::now();
+      for (Ulong i = 0; i < calls; ++i) {
+        fn();
+      }
+      per_item[s] = (elapsed_ns(start) / ((double)calls * items));
+    }
+    std::sort(per_item.begin(), per_item.end());
+    BenchResult r = {name, samples, 0.0, 0.0, 0.0, per_item.front(), 0.0};
+    for (double v : per_item) {
+      r.mean += v;
+    }
+    r.mean /= samples;
+    for (double v : per_item) {
+      r.stddev += ((v - r.mean) * (v - r.mean));
+    }
+    r.stddev = sqrt(r.stddev / ((samples > 1) ? (samples - 1) : 1));
+    r.median = ((samples & 1) ? per_item[samples / 2] : ((per_item[(samples / 2) - 1] + per_item[samples / 2]) * 0.5));
+    r.p90    = per_item[(Uint)ceil(0.9 * samples) - 1];
+    results.push_back(r);
+    printf("%-34s %10.3f %10.3f %8.3f %10.3f %10.3f\n", name.c_str(), r.median, r.mean, r.stddev, r.min, r.p90);
+    fflush(stdout);
+  }
+};
+
+/* Baseline files hold one case per line, its name and median nanoseconds per item, `#` starts a comment. */
+static bool read_baseline(const char *path, std::map<std::string, double> *out) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    char name[200];
+    double ns;
+    if (line[0] != '#' && sscanf(line, "%199s %lf", name, &ns) == 2) {
+      (*out)[name] = ns;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+static bool write_baseline(const char *path, const std::vector<BenchResult> &results, const char *renderer) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "# Median nanoseconds per item, written by microbench --write-baseline.\n");
+  fprintf(file, "# renderer: %s\n", renderer);
+  for (const auto &r : results) {
+    fprintf(file, "%s %.4f\n", r.name.c_str(), r.median);
+  }
+  return (fclose(file) == 0);
+}
+
+/* Returns how many cases regressed. */
+static Uint compare_baseline(const std::vector<BenchResult> &results, const std::map<std::string, double> &baseline, double threshold) {
+  Uint regressions = 0;
+  printf("\n%-34s %10s %10s %8s\n", "case", "baseline", "median", "change");
+  for (const auto &r : results) {
+    auto it = baseline.find(r.name);
+    if (it == baseline.end() || it->second <= 0.0) {
+      printf("%-34s %10s %10.3f %8s\n", r.name.c_str(), "-", r.median, "new");
+      continue;
+    }
+    double change = (((r.median / it->second) - 1.0) * 100.0);
+    bool regressed = (change > threshold);
+    regressions += regressed;
+    printf("%-34s %10.3f %10.3f %+7.1f%%%s\n", r.name.c_str(), it->second, r.median, change, (regressed ? "  REGRESSION" : ""));
+  }
+  return regressions;
+}
+
+/* Unit boxes in a jittered grid with `count` cells, the same every run. */
+template <typename Box>
+static std::vector<Box> box_grid(Uint count, float spacing) {
+  Uint side = 1;
+  while ((side * side * side) < count) {
+    ++side;
+  }
+  std::vector<Box> boxes(count);
+  for (Uint i = 0; i < count; ++i) {
+    Uint h = (i * 2654435761u);
+    float jitter = ((((h >> 16) & 0xff) / 255.0f) - 0.5f);
+    boxes[i].pos  = vec3((((i % side) * spacing) + jitter), (((i / side) % side) * spacing), (((i / (side * side)) * spacing) - jitter));
+    boxes[i].size = vec3(1.0f, 1.0f, 1.0f);
+  }
+  return boxes;
+}
+
+typedef struct {
+  vec3 pos;
+  vec3 size;
+} BenchBox;
+
+static void bench_math(MicroBench *bench) {
+  for (Uint n : {64u, 1024u, 16384u}) {
+    std::vector<vec3> pos(n, vec3(0.0f, 10.0f, 0.0f));
+    std::vector<vec3> vel(n, vec3(1.0f, 0.0f, -1.0f));
+    bench->run("rk4_step", n, n, [&] {
+      for (Uint i = 0; i < n; ++i) {
+        rk4_step(&pos[i], &vel[i], FRAMETIME_S, GRAVITY_FORCE);
+      }
+      keep(pos[0]);
+    });
+  }
+  for (Uint n : {24u, 1024u, 65536u}) {
+    MVector<float> verts;
+    for (Uint i = 0; i < (n * 6); ++i) {
+      verts.push_back((((i * 2654435761u) >> 8) & 0xffff) / 655.36f - 50.0f);
+    }
+    bench->run("verts_size_vec", n, n, [&] {
+      vec3 size = verts_size_vec(verts);
+      keep(size);
+    });
+  }
+  for (Uint n : {64u, 1024u, 16384u}) {
+    std::vector<mat4> mats(n);
+    for (Uint i = 0; i < n; ++i) {
+      mats[i] = (translate_matrix(mat4(1.0f), vec3((float)i, 0.0f, -(float)i)) * rotation_matrix(vec3((float)(i % 360), 30.0f, 0.0f)) *
+                 scale_matrix(mat4(1.0f), vec3((1.0f + (float)(i % 7)), 2.0f, 0.5f)));
+    }
+    bench->run("mat_scale_vec", n, n, [&] {
+      vec3 sum(0.0f);
+      for (Uint i = 0; i < n; ++i) {
+        sum += mat_scale_vec(mats[i]);
+      }
+      keep(sum);
+    });
+  }
+}
+
+static void bench_collision(MicroBench *bench) {
+  /* Every pair, the way `mesh_collison_check()` tests two meshes. */
+  for (Uint n : {64u, 256u, 1024u}) {
+    std::vector<BenchBox> boxes = box_grid<BenchBox>(n, 1.2f);
+    bench->run("mesh_colliding", n, ((Ulong)n * (n - 1) / 2), [&] {
+      Uint hits = 0;
+      for (Uint i = 0; i < n; ++i) {
+        const BenchBox *a = &boxes[i];
+        for (Uint j = (i + 1); j < n; ++j) {
+          const BenchBox *b = &boxes[j];
+          hits += MESH_COLLIDING(a, b);
+        }
+      }
+      keep(hits);
+    });
+  }
+  /* The axis of least overlap of pairs that do collide, in the order `resolve_camera_collision()` tries them. */
+  for (Uint n : {64u, 1024u, 16384u}) {
+    std::vector<BenchBox> a = box_grid<BenchBox>(n, 3.0f);
+    std::vector<BenchBox> b = a;
+    for (Uint i = 0; i < n; ++i) {
+      Uint h = (i * 2654435761u);
+      b[i].pos += vec3(((((h >> 8) & 0xff) / 255.0f) - 0.5f), ((((h >> 16) & 0xff) / 255.0f) - 0.5f), ((((h >> 24) & 0xff) / 255.0f) - 0.5f));
+    }
+    bench->run("mesh_overlap_least", n, n, [&] {
+      Uint axes = 0;
+      for (Uint i = 0; i < n; ++i) {
+        const BenchBox *o = &a[i];
+        const BenchBox *so = &b[i];
+        axes += (MESH_OVERLAP_LEAST_L(o, so) ? 1 : MESH_OVERLAP_LEAST_R(o, so) ? 2 : MESH_OVERLAP_LEAST_T(o, so) ? 3 :
+                 MESH_OVERLAP_LEAST_B(o, so) ? 4 : MESH_OVERLAP_LEAST_F(o, so) ? 5 : MESH_OVERLAP_LEAST_BK(o, so) ? 6 : 0);
+      }
+      keep(axes);
+    });
+  }
+  /* One query per camera position, against a scene of `n` boxes. */
+  for (Uint n : {64u, 1024u, 16384u}) {
+    std::vector<BenchBox> boxes = box_grid<BenchBox>(n, 2.0f);
+    AabbTree scene;
+    for (const auto &box : boxes) {
+      scene.insert(aabb_from_box(box.pos, box.size), nullptr);
+    }
+    const Uint queries = 256;
+    std::vector<vec3> spots(queries);
+    for (Uint i = 0; i < queries; ++i) {
+      spots[i] = boxes[((i * 2654435761u) % n)].pos + vec3(0.3f, 0.8f, -0.2f);
+    }
+    CameraObject camera = {};
+    camera.size = vec3(1.0f, 2.0f, 1.0f);
+    bench->run("check_camera_collision", n, queries, [&] {
+      for (Uint i = 0; i < queries; ++i) {
+        camera.pos = spots[i];
+        camera.vel = vec3(0.0f);
+        check_camera_collision(&camera, &scene);
+        keep(camera.pos);
+      }
+    });
+  }
+}
+
+/* A step of the gpu backend with its state going through the cpu both ways, as `perform()` does when not
+ * resident, and the upload and readback of the resident mode on their own. */
+static void bench_compute(MicroBench *bench) {
+  for (Uint n : {1024u, 16384u, 65536u}) {
+    std::vector<BenchBox> boxes = box_grid<BenchBox>(n, 1.5f);
+    /* Each object owns and deletes its program, so both get their own. */
+    ComputeObject *compute  = new ComputeObject();
+    ComputeObject *resident = new ComputeObject();
+    Uint compute_program  = create_comp_shader_program("src/shader/shader.comp");
+    Uint resident_program = create_comp_shader_program("src/shader/shader.comp");
+    finish_shader_programs();
+    compute->init(compute_program, n);
+    resident->init(resident_program, n, true);
+    for (Uint i = 0; i < n; ++i) {
+      compute->data[i].pos  = resident->data[i].pos  = boxes[i].pos;
+      compute->data[i].size = resident->data[i].size = boxes[i].size;
+    }
+    resident->upload();
+    bench->run("compute_perform", n, n, [&] {
+      compute->perform(GRAVITY_OPERATION);
+    });
+    bench->run("compute_upload", n, n, [&] {
+      resident->upload(0, n);
+    });
+    bench->run("compute_readback", n, n, [&] {
+      resident->readback();
+    });
+    delete compute;
+    delete resident;
+  }
+}
+
+int main(int argc, char **argv) {
+  MicroBench bench;
+  const char *baseline_path = MICROBENCH_BASELINE;
+  bool write = false;
+  bool require = false;
+  bool gl = true;
+  double threshold = 10.0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--baseline") == 0 && (i + 1) < argc) {
+      baseline_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--write-baseline") == 0) {
+      write = true;
+    }
+    else if (strcmp(argv[i], "--require-baseline") == 0) {
+      require = true;
+    }
+    else if (strcmp(argv[i], "--threshold") == 0 && (i + 1) < argc) {
+      threshold = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--samples") == 0 && (i + 1) < argc) {
+      bench.samples = glm::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--filter") == 0 && (i + 1) < argc) {
+      bench.filter = argv[++i];
+    }
+    else if (strcmp(argv[i], "--no-gl") == 0) {
+      gl = false;
+    }
+  }
+  HeadlessContext hc = {EGL_NO_DISPLAY, EGL_NO_CONTEXT, 0, 0, 0};
+  if (gl && !init_headless_context(&hc, 64, 64)) {
+    LOG_WARN("No GL context, the compute cases are skipped\n");
+    gl = false;
+  }
+  const char *gl_renderer = (gl ? (const char *)glGetString(GL_RENDERER) : "none");
+  /* Copied, the string goes away with the context. */
+  std::string renderer = (gl_renderer ? gl_renderer : "unknown");
+  printf("%-34s %10s %10s %8s %10s %10s   (ns per item)\n", "case", "median", "mean", "stddev", "min", "p90");
+  bench_math(&bench);
+  bench_collision(&bench);
+  if (gl) {
+    bench_compute(&bench);
+    release_headless_context(&hc);
+  }
+  if (write) {
+    if (!write_baseline(baseline_path, bench.results, renderer.c_str())) {
+      fprintf(stderr, "Failed to write %s\n", baseline_path);
+      return 1;
+    }
+    printf("\nbaseline written to %s\n", baseline_path);
+    return 0;
+  }
+  std::map<std::string, double> baseline;
+  if (!read_baseline(baseline_path, &baseline)) {
+    printf("\nno baseline at %s, nothing compared, write one with --write-baseline\n", baseline_path);
+    return (require ? 1 : 0);
+  }
+  Uint regressions = compare_baseline(bench.results, baseline, threshold);
+  if (regressions) {
+    printf("\n%u cases regressed by more than %.1f%%\n", regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
@@ -34,6 +34,14 @@ void handle_events(GameObject *game) {
       SDL_WarpMouseInWindow(game->win, (game->width / 2), (game->height / 2));
       change_camera_angle(&game->camera, {(float)game->ev.motion.xrel, (float)game->ev.motion.yrel});
       break;
+    case SDL_MOUSEBUTTONDOWN: {
+      /* Left click prints the mesh in the crosshair, right click the one closest to the camera. */
+      Mesh *mesh = ((game->ev.button.button == SDL_BUTTON_LEFT) ? pick_mesh(&game->camera, &game->scene, 50.0f) : nearest_mesh(game->camera.pos, &game->scene));
+      if (mesh) {
+        print_mesh_pos(mesh);
+      }
+      break;
+    }
     }
   }
 }
@@ -60,51 +68,6 @@ inline namespace Shapes {
     0.0f,  0.5f,  0.0f, 0.0f, 0.0f, 1.0f  /* Top-center */
   };
   MVector<Uint> triangleIndices = {0, 1, 2};
-
-  /* Vertices for a cube (24 vertices, each with a unique position and normal) */
-  static const MVector<float> cubeVertices = {
-    /* Positions */        /* Normals */
-    /* Back face */
-    -0.5f, -0.5f, -0.5f,   0.0f,  0.0f, -1.0f,
-     0.5f, -0.5f, -0.5f,   0.0f,  0.0f, -1.0f,
-     0.5f,  0.5f, -0.5f,   0.0f,  0.0f, -1.0f,
-    -0.5f,  0.5f, -0.5f,   0.0f,  0.0f, -1.0f,
-    /* Front face */
-    -0.5f, -0.5f,  0.5f,   0.0f,  0.0f,  1.0f,
-     0.5f, -0.5f,  0.5f,   0.0f,  0.0f,  1.0f,
-     0.5f,  0.5f,  0.5f,   0.0f,  0.0f,  1.0f,
-    -0.5f,  0.5f,  0.5f,   0.0f,  0.0f,  1.0f,
-    /* Left face */
-    -0.5f, -0.5f, -0.5f,  -1.0f,  0.0f,  0.0f,
-    -0.5f,  0.5f, -0.5f,  -1.0f,  0.0f,  0.0f,
-    -0.5f,  0.5f,  0.5f,  -1.0f,  0.0f,  0.0f,
-    -0.5f, -0.5f,  0.5f,  -1.0f,  0.0f,  0.0f,
-    /* Right face */
-    0.5f, -0.5f, -0.5f,    1.0f,  0.0f,  0.0f,
-    0.5f,  0.5f, -0.5f,    1.0f,  0.0f,  0.0f,
-    0.5f,  0.5f,  0.5f,    1.0f,  0.0f,  0.0f,
-    0.5f, -0.5f,  0.5f,    1.0f,  0.0f,  0.0f,
-    /* Bottom face */
-    -0.5f, -0.5f, -0.5f,   0.0f, -1.0f,  0.0f,
-    -0.5f, -0.5f,  0.5f,   0.0f, -1.0f,  0.0f,
-     0.5f, -0.5f,  0.5f,   0.0f, -1.0f,  0.0f,
-     0.5f, -0.5f, -0.5f,   0.0f, -1.0f,  0.0f,
-    /* Top face */
-    -0.5f,  0.5f, -0.5f,   0.0f,  1.0f,  0.0f,
-    -0.5f,  0.5f,  0.5f,   0.0f,  1.0f,  0.0f,
-     0.5f,  0.5f,  0.5f,   0.0f,  1.0f,  0.0f,
-     0.5f,  0.5f, -0.5f,   0.0f,  1.0f,  0.0f
-  };
-
-  // Indices for each face (36 indices total)
-  static const MVector<Uint> cubeIndices = {
-    0,  1,  2,  2,  3,  0,  // Back face
-    4,  5,  6,  6,  7,  4,  // Front face
-    8,  9,  10, 10, 11, 8,  // Left face
-    12, 13, 14, 14, 15, 12, // Right face
-    16, 17, 18, 18, 19, 16, // Bottom face
-    20, 21, 22, 22, 23, 20  // Top face
-  };
 }
 
 void test_mat4(void) {
@@ -136,8 +99,74 @@ void test_mat4(void) {
   fflush(stdout);
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+  /* Everything logged from here on is written by the log thread, see log.h. */
+  logger().start();
   GameObject game;
+  /* Select the physics backend, the cpu backend is used with `--cpu`, and `--threads N` sets its thread count.
+   * `--local-size N` sets the workgroup size of the gpu backend, and `--soa` makes it use one buffer per body field.
+   * `--particles N` adds a particle fountain of up to N particles, and `--particle-bench` times its update pass and exits.
+   * `--gpu-draw` draws the gpu backend's bodies straight from its buffers with one indirect draw, and `--no-cull` turns off its frustum culling.
+   * `--shader-cache DIR` keeps linked shader programs in DIR instead of shader_cache, and `--no-shader-cache` always compiles them.
+   * `--profile NAME` profiles every frame, and writes the last frames to NAME.json as a chrome trace and NAME.csv on exit.
+   * `--record FILE` records the bodies and camera of every frame to FILE, and `--replay FILE` plays such a recording back
+   * instead of simulating, from frame N with `--replay-from N`. */
+  game.cpu_physics = false;
+  Uint thread_count = 0;
+  Uint local_size = 64;
+  bool soa = false;
+  Uint particle_count = 0;
+  bool particle_bench = false;
+  bool gpu_draw = false;
+  bool gpu_cull = true;
+  const char *profile_name = nullptr;
+  const char *record_name = nullptr;
+  const char *replay_name = nullptr;
+  Uint replay_frame = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--cpu") == 0) {
+      game.cpu_physics = true;
+    }
+    else if (strcmp(argv[i], "--threads") == 0 && (i + 1) < argc) {
+      thread_count = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--local-size") == 0 && (i + 1) < argc) {
+      local_size = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--soa") == 0) {
+      soa = true;
+    }
+    else if (strcmp(argv[i], "--particles") == 0 && (i + 1) < argc) {
+      particle_count = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--particle-bench") == 0) {
+      particle_bench = true;
+    }
+    else if (strcmp(argv[i], "--gpu-draw") == 0) {
+      gpu_draw = true;
+    }
+    else if (strcmp(argv[i], "--no-cull") == 0) {
+      gpu_cull = false;
+    }
+    else if (strcmp(argv[i], "--shader-cache") == 0 && (i + 1) < argc) {
+      shader_cache().dir = argv[++i];
+    }
+    else if (strcmp(argv[i], "--no-shader-cache") == 0) {
+      shader_cache().enabled = false;
+    }
+    else if (strcmp(argv[i], "--profile") == 0 && (i + 1) < argc) {
+      profile_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--record") == 0 && (i + 1) < argc) {
+      record_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--replay") == 0 && (i + 1) < argc) {
+      replay_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--replay-from") == 0 && (i + 1) < argc) {
+      replay_frame = atoi(argv[++i]);
+    }
+  }
   game.camera.sensitivity = 0.07f;
   // calculate_yaw_pitch_from_direction(&game.camera, {0.0f, 0.0f, -3.0f});
   yaw_pitch_from_direction(vec3(0.0f, 0.0f, -3.0f), &game.camera.yaw, &game.camera.pitch);
@@ -153,24 +182,85 @@ int main(void) {
   /* Create an OpenGL context. */
   /* Setup view-port. */
   glViewport(0, 0, game.width, game.height);
-  /* Load and compile shaders. */
+  /* Load and compile shaders.  Every program is created before any is finished or queried, so the driver
+   * compiles and links them all at once, and nothing reads a program before its link is checked. */
   game.shader_program = create_shader_program({
     {"src/shader/shader.vert", GL_VERTEX_SHADER},
     {"src/shader/shader.frag", GL_FRAGMENT_SHADER},
     }, {}
   );
-  game.compute.init(create_comp_shader_program("src/shader/shader.comp"), 2);
+  game.instanced_program = create_shader_program({
+    {"src/shader/instanced.vert", GL_VERTEX_SHADER},
+    {"src/shader/shader.frag",    GL_FRAGMENT_SHADER},
+    }, {}
+  );
+  Uint compute_program = 0;
+  if (!game.cpu_physics) {
+    /* Falls back to aos the same way `create_comp_shader_program()` does, the render programs have to match. */
+    soa = (soa && body_soa_supported());
+    compute_program = create_comp_shader_program("src/shader/shader.comp", local_size, soa);
+  }
+  if (particle_bench && !particle_count) {
+    particle_count = (1 << 20);
+  }
+  Uint particle_program = 0;
+  Uint particle_render_program = 0;
+  if (particle_count) {
+    particle_program = create_comp_shader_program("src/shader/shader.comp", local_size);
+    particle_render_program = create_shader_program({
+      {"src/shader/particle.vert", GL_VERTEX_SHADER},
+      {"src/shader/particle.frag", GL_FRAGMENT_SHADER},
+      }, {}
+    );
+  }
+  /* The bodies are drawn from the gpu buffers, the readback then only feeds the scene queries. */
+  gpu_draw = (gpu_draw && !game.cpu_physics && !replay_name);
+  if (gpu_draw && !IndirectRenderer::supported(soa)) {
+    LOG_WARN("Drawing from the body buffers needs more storage buffers than the driver supports, using instancing\n");
+    gpu_draw = false;
+  }
+  Uint cull_program = 0;
+  Uint body_program = 0;
+  if (gpu_draw) {
+    cull_program = create_comp_shader_program("src/shader/shader.comp", local_size, soa);
+    body_program = create_body_shader_program({
+      {"src/shader/body.vert",   GL_VERTEX_SHADER},
+      {"src/shader/shader.frag", GL_FRAGMENT_SHADER},
+      }, soa
+    );
+  }
+  /* Every program is created by now, so this is the whole startup cost of the shaders, cold or warm. */
+  finish_shader_programs();
+  shader_cache().report();
+  game.frame.init();
+  ThreadPool pool(game.cpu_physics ? thread_count : 1);
+  if (game.cpu_physics) {
+    game.cpu_compute.init(2, true);
+    game.cpu_compute.pool = &pool;
+  }
+  else {
+    game.compute.init(compute_program, 2, true);
+  }
+  ParticleSystem particles;
+  if (particle_count) {
+    particles.init(particle_program, particle_render_program, particle_count);
+    if (particle_bench) {
+      particles.benchmark(100);
+      cleanup(&game);
+      exit(CLEAN_EXIT);
+    }
+    particles.add_emitter({{0.0f, 0.0f, -5.0f}, {0.0f, 8.0f, 0.0f}, 1.5f, (particle_count / 4.0f), 4.0f, 0.05f, {1.0f, 0.6f, 0.2f}, 0.0f});
+  }
   init_camera(&game.camera);
   init_projection(&game, radiansf(80.0f), (game.width / game.height), 0.1f, 100.0f);
   /* Create a Mesh object for the triangle */
   game.sun.pos = {0.0f, 20.0f, 0.0f};
   set_sun_light(&game, direction_vec(vec3(0.0f), game.sun.pos), {1.0f, 1.0f, 1.0f}, 0.4f);
-  set_sun_light_uniforms(&game);
   Mesh triangle(triangleVertices, triangleIndices, game.shader_program, red_color_vec);
   Mesh floor(floor_vertices, floor_indices, game.shader_program);
   floor.pos.y = -2.0f;
-  Mesh cube(cubeVertices, cubeIndices, game.shader_program, red_color_vec);
-  Mesh cube2(cubeVertices, cubeIndices, game.shader_program, blue_color_vec);
+  Mesh cube(MeshObject::cube_vertices, MeshObject::cube_indices, game.shader_program, red_color_vec);
+  Mesh cube2(MeshObject::cube_vertices, MeshObject::cube_indices, game.shader_program, blue_color_vec);
   MESH_SET(&cube2, STATIC_MESH);
   cube.pos.y = 4.0f;
   cube._scale.x = 2.0f;
@@ -178,40 +268,225 @@ int main(void) {
   MVector<Mesh> meshes;
   meshes.push_back(cube);
   meshes.push_back(cube2);
+  /* The physics bodies all share one cube, drawn as instances in a single draw call. */
+  InstancedMesh cubes(MeshObject::cube_vertices, MeshObject::cube_indices, game.instanced_program);
+  for (auto &mesh : meshes) {
+    cubes.add(mesh.pos, mesh.rotation, mesh._scale, mesh.color);
+  }
+  for (Uint i = 0; i < 2; ++i) {
+    physics_data(&game)[i] = meshes[i].compute_data();
+  }
+  physics_upload(&game);
+  add_mesh_to_scene(&game.scene, &floor);
+  add_mesh_to_scene(&game.scene, &triangle);
+  for (auto &mesh : meshes) {
+    add_mesh_to_scene(&game.scene, &mesh);
+  }
+  if (!game.cpu_physics) {
+    game.compute.init_grid(GRID_TABLE_SIZE, grid_cell_size(game.compute.data));
+  }
+  IndirectRenderer indirect;
+  if (gpu_draw) {
+    MVector<Uint> body_shape;
+    MVector<vec3> body_scale;
+    MVector<vec3> body_color;
+    for (auto &mesh : meshes) {
+      body_shape.push_back(0);
+      body_scale.push_back(mesh._scale);
+      body_color.push_back(mesh.color);
+    }
+    indirect.init(
+      cull_program, body_program,
+      {geometry_arena().get(MeshObject::cube_vertices, MeshObject::cube_indices)}, body_shape, body_scale, body_color
+    );
+    indirect.cull = gpu_cull;
+  }
+  /* Physics runs at a fixed rate.  The cpu backend steps on its own thread, the gpu backend runs as many
+   * steps as are due each frame.  Either way the drawn state is interpolated between the last two steps. */
+  SimThread sim;
+  FixedStep fixed;
+  Uint span = 1;
+  MVector<ComputeData> prev_bodies = physics_data(&game);
+  MVector<ComputeData> bodies;
+  /* A replay decodes the bodies and camera of each frame from the recording, and nothing is simulated. */
+  Replay replay;
+  if (replay_name && !replay.open(replay_name)) {
+    LOG_ERROR("Could not open the recording %s\n", replay_name);
+    replay_name = nullptr;
+  }
+  Recorder recorder;
+  if (record_name && !replay_name && !recorder.start(record_name, physics_data(&game).size())) {
+    LOG_ERROR("Could not record to %s\n", record_name);
+  }
+  if (game.cpu_physics && !replay_name) {
+    sim.start(&game.cpu_compute);
+  }
+  RenderQueue queue;
+  /* Everything drawn, the scenery first and then the bodies, which are drawn as instances of `cubes`. */
+  MVector<Mesh *> drawables = {&floor, &triangle};
+  const Uint first_body = drawables.size();
+  for (auto &mesh : meshes) {
+    drawables.push_back(&mesh);
+  }
+  FrustumCuller culler;
+  /* Bodies of a replay are drawn one mesh at a time, with `Mesh::draw()`. */
+  MVector<Uint> replay_draw;
+  RecordedCamera recorded_camera;
+  if (profile_name) {
+    profiler().enable();
+  }
+  time_point last_frame = high_resolution_clock::now();
   /* Main loop. */
   while (game.state.is_set<RUNNING>()) {
     time_point frame_start = high_resolution_clock::now();
-    prosses_held_keys(&game);
-    handle_events(&game);
+    PROFILE_BEGIN_FRAME();
+    double elapsed = duration<double>(frame_start - last_frame).count();
+    if (replay_name && !replay.frame(replay_frame++, &bodies, &recorded_camera)) {
+      /* The end of the recording. */
+      game.state.unset<RUNNING>();
+      PROFILE_END_FRAME();
+      continue;
+    }
+    {
+      PROFILE_SCOPE("input");
+      prosses_held_keys(&game);
+      handle_events(&game);
+    }
     glClear(GL_COLOR_BUFFER_BIT);
-    update_camera(&game.camera);
-    /* Draw floor first. */
-    draw_mesh(&game, &floor);
-    /* Draw the triangle. */
-    draw_mesh(&game, &triangle);
-    check_camera_collision(&game.camera, &cube2);
-    for (Uint i = 0; i < 2; ++i) {
-      game.compute.data[i] = meshes[i].compute_data();
-    }
-    game.compute.perform(GRAVITY_OPERATION);
-    for (Uint i = 0; i < 2; ++i) {
-      meshes[i].compute_data(&game.compute.data[i]);
-    }
-    // apply_gravity(&cube, FRAMETIME_S);
-    for (Uint i = 0; i < 2; ++i) {
-      game.compute.data[i] = meshes[i].compute_data();
-    }
-    game.compute.perform(COLLISION_OPERATION);
-    for (Uint i = 0; i < 2; ++i) {
-      meshes[i].compute_data(&game.compute.data[i]);
-      draw_mesh(&game, &meshes[i]);
-    }
-    printf("pos.y: %f, vel.y: %f\n", game.compute.data[0].pos.y, game.compute.data[0].vel.y);
+    {
+      PROFILE_SCOPE("update_camera");
+      if (replay_name) {
+        game.camera.pos   = recorded_camera.pos;
+        game.camera.yaw   = recorded_camera.yaw;
+        game.camera.pitch = recorded_camera.pitch;
+        get_camera_direction(&game.camera);
+        game.camera.view = look_at_rh(game.camera.pos, (game.camera.pos - game.camera.direction), game.camera.up);
+      }
+      else {
+        update_camera(&game.camera);
+      }
+      update_frame_uniforms(&game);
+    }
+    {
+      PROFILE_SCOPE("physics");
+      if (replay_name) {
+        /* Already decoded above. */
+      }
+      else if (game.cpu_physics) {
+        sim.interpolate(&bodies);
+      }
+      else {
+        Uint steps = fixed.advance(elapsed);
+        if (steps) {
+          /* Body state stays on the gpu between all steps, and a copy of it is queued for the cpu once per frame. */
+          for (Uint i = 0; i < steps; ++i) {
+            physics_perform(&game, FUSED_OPERATION);
+          }
+          game.compute.request_readback(steps);
+        }
+        /* Whatever copy finished by now is drawn, usually the one of the frame before, nothing waits on the gpu. */
+        Uint done = game.compute.poll_readback(&prev_bodies);
+        if (done) {
+          span = done;
+        }
+        /* `prev_bodies` is `span` steps behind, so scale the fraction of the last step accordingly. */
+        interpolate_bodies(prev_bodies, game.compute.data, (((span - 1) + fixed.alpha()) / span), &bodies);
+      }
+    }
+    last_frame = frame_start;
+    {
+      PROFILE_SCOPE("scene");
+      for (Uint i = 0; i < meshes.size() && i < bodies.size(); ++i) {
+        meshes[i].compute_data(&bodies[i]);
+        update_mesh_in_scene(&game.scene, &meshes[i]);
+      }
+      if (!replay_name) {
+        check_camera_collision(&game.camera, &game.scene);
+      }
+      if (recorder.is_recording()) {
+        PROFILE_SCOPE("record");
+        recorder.record(bodies, {game.camera.pos, game.camera.yaw, game.camera.pitch});
+      }
+    }
+    {
+      PROFILE_SCOPE("cull");
+      /* Only what is inside the view frustum goes to the render queue, which draws it sorted in one flush. */
+      culler.clear();
+      for (auto *mesh : drawables) {
+        culler.add(mesh->bounds());
+      }
+      culler.cull(game.projection * game.camera.view);
+      cubes.clear();
+      replay_draw.clear();
+      for (Uint i : culler.visible_list()) {
+        if (i < first_body) {
+          drawables[i]->submit(&queue);
+        }
+        else if (replay_name) {
+          replay_draw.push_back(i);
+        }
+        else {
+          cubes.add(drawables[i]->pos, drawables[i]->rotation, drawables[i]->_scale, drawables[i]->color);
+        }
+      }
+    }
+    {
+      PROFILE_GPU_SCOPE("draw");
+      /* The gpu draw path culls the bodies itself. */
+      if (!gpu_draw) {
+        cubes.submit(&queue);
+      }
+      queue.flush();
+      for (Uint i : replay_draw) {
+        draw_mesh(&game, drawables[i]);
+      }
+      if (gpu_draw) {
+        indirect.draw(game.projection * game.camera.view);
+      }
+    }
+    if (particle_count) {
+      PROFILE_GPU_SCOPE("particles");
+      particles.update(elapsed);
+      particles.draw();
+    }
+    LOG_INFO("pos.y: %f, vel.y: %f, visible: %u/%u, cull: %.3f us\n", bodies[0].pos.y, bodies[0].vel.y, culler.stats.visible, culler.stats.tested, culler.stats.micros);
     // mesh_collison_check(&cube, &cube2);
-    /* Swap buffers. */
-    SDL_GL_SwapWindow(game.win);
+    {
+      PROFILE_SCOPE("swap");
+      /* Swap buffers. */
+      SDL_GL_SwapWindow(game.win);
+    }
+    /* The sleep that paces the frame is not part of it. */
+    PROFILE_END_FRAME();
     frame_end(frame_start);
   }
+  if (game.cpu_physics && !replay_name) {
+    sim.stop();
+  }
+  if (recorder.is_recording() && !recorder.stop()) {
+    LOG_ERROR("Could not write all of the recording to %s\n", record_name);
+  }
+  /* The log is written out before the reports, so they do not end up in the middle of it. */
+  logger().stop();
+  logger().report();
+  if (game.cpu_physics) {
+    pool.report();
+  }
+  else {
+    game.compute.report_readback();
+  }
+  if (record_name && !replay_name) {
+    recorder.report();
+  }
+  queue.report();
+  culler.report();
+  if (profile_name) {
+    profiler().report();
+    std::string name = profile_name;
+    if (!profiler().write_trace((name + ".json").c_str()) || !profiler().write_csv((name + ".csv").c_str())) {
+      LOG_ERROR("Could not write the profile to %s.json and %s.csv\n", profile_name, profile_name);
+    }
+  }
   /* Cleanup. */
   cleanup(&game);
   exit(CLEAN_EXIT);
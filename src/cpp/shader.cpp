@@ -1,73 +1,371 @@
 #include "../include/prototypes.h"
 
-std::string load_shader_source(const char *path) {
-  std::ifstream file(path);
-  if (file.is_open()) {
-    std::stringstream ss;
-    ss << file.rdbuf();
-    return ss.str();
-  }
-  return "";
-}
-
-std::string load_shader_source_with_includes(const char *path,
-                                             const MVector<const char *> &includes) {
-  std::string ret;
-  for (const auto &inc : includes) {
-    ret += load_shader_source(inc);
-    ret += '\n';
-  }
-  ret += load_shader_source(path);
-  return ret;
-}
-
-Uint load_shader(const char *path, const MVector<const char *> &includes, Uint shader_type) {
-  /* Open the shader file. */
-  std::string source = load_shader_source_with_includes(path, includes);
-  const char *source_cstr = source.c_str();
-  /* Create the shader. */
-  Uint shader = glCreateShader(shader_type);
-  glShaderSource(shader, 1, &source_cstr, nullptr);
-  glCompileShader(shader);
-  /* Check for compalation errors. */
-  int success;
-  glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    char info_log[512];
-    glGetShaderInfoLog(shader, 512, nullptr, info_log);
-    printf("Error compiling shader: %s\n", info_log);
+#include <thread>
+#include <unordered_map>
+
+/* A shader file split into lines, read once per run however often it is included. */
+typedef struct {
+  std::vector<std::string> lines;
+  bool found;
+} ParsedShaderFile;
+
+/* Programs whose compile and link were issued but not checked yet, see `finish_shader_programs()`. */
+typedef struct {
+  Uint program;
+  MVector<Uint> shaders;
+  std::vector<ShaderStage> stages;
+  Ulong key;
+} PendingProgram;
+
+static std::unordered_map<std::string, ParsedShaderFile> parsed_shader_files;
+static std::vector<PendingProgram> pending_programs;
+static time_point<high_resolution_clock> pending_start;
+static bool parallel_compile = false;
+
+static const ParsedShaderFile &parse_shader_file(const std::string &path) {
+  auto it = parsed_shader_files.find(path);
+  if (it != parsed_shader_files.end()) {
+    return it->second;
+  }
+  ParsedShaderFile &file = parsed_shader_files[path];
+  std::ifstream in(path);
+  file.found = in.is_open();
+  std::string line;
+  while (std::getline(in, line)) {
+    file.lines.push_back(line);
   }
-  return shader;
+  return file;
 }
 
-Uint create_shader_program(const MVector<Pair<const char *, Uint>> &parts, const MVector<const char *> &includes) {
-  /* Load shaders. */
-  MVector<Uint> shaders;
-  for (const auto &pair : parts) {
-    shaders.push_back(load_shader(pair.first, includes, pair.second));
+/* The directive `line` is, with the leading `#` and whitespace skipped, or empty when it is none. */
+static std::string directive(const std::string &line) {
+  Ulong pos = line.find_first_not_of(" \t");
+  if (pos == std::string::npos || line[pos] != '#') {
+    return "";
+  }
+  pos = line.find_first_not_of(" \t", (pos + 1));
+  return ((pos == std::string::npos) ? "" : line.substr(pos));
+}
+
+/* The file named by an `#include "file"` or `#include <file>` directive, relative to the directory of `from`. */
+static bool include_path(const std::string &dir, const std::string &from, std::string *path) {
+  if (dir.compare(0, 7, "include") != 0) {
+    return false;
+  }
+  Ulong open = dir.find_first_of("\"<", 7);
+  if (open == std::string::npos) {
+    return false;
+  }
+  Ulong close = dir.find((dir[open] == '"') ? '"' : '>', (open + 1));
+  if (close == std::string::npos) {
+    return false;
+  }
+  Ulong slash = from.find_last_of('/');
+  *path = (((slash == std::string::npos) ? "" : from.substr(0, (slash + 1))) + dir.substr((open + 1), (close - open - 1)));
+  return true;
+}
+
+/* Append the lines `[first, last)` of `path` to `stage`, with every include replaced by the file it names.
+ * Each file gets a source number in `stage->files`, and `#line` directives around every include keep the
+ * line numbers of compile errors pointing into the file they are in. */
+static void expand_shader_lines(const std::string &path, Ulong first, Ulong last, ShaderStage *stage, std::vector<std::string> *stack, std::vector<std::string> *seen);
+
+static Uint shader_source_number(ShaderStage *stage, const std::string &path) {
+  for (Uint i = 0; i < stage->files.size(); ++i) {
+    if (stage->files[i] == path) {
+      return i;
+    }
+  }
+  stage->files.push_back(path);
+  return (stage->files.size() - 1);
+}
+
+/* Expand `path` as included at this point, then continue at `resume_line` of `parent`.  An include that
+ * is skipped leaves an empty line, so the lines after it keep their numbers. */
+static void expand_include(const std::string &path, const std::string &parent, Ulong resume_line, ShaderStage *stage, std::vector<std::string> *stack, std::vector<std::string> *seen) {
+  const ParsedShaderFile &file = parse_shader_file(path);
+  if (!file.found) {
+    LOG_ERROR("Shader include %s from %s not found\n", path.c_str(), parent.c_str());
+    stage->source += '\n';
+    return;
+  }
+  for (const auto &s : *stack) {
+    if (s == path) {
+      LOG_ERROR("Shader include %s from %s is recursive\n", path.c_str(), parent.c_str());
+      stage->source += '\n';
+      return;
+    }
+  }
+  for (const auto &s : *seen) {
+    if (s == path) {
+      /* A `#pragma once` file that is already in. */
+      stage->source += '\n';
+      return;
+    }
+  }
+  stage->source += ("#line 1 " + std::to_string(shader_source_number(stage, path)) + "\n");
+  stack->push_back(path);
+  expand_shader_lines(path, 0, file.lines.size(), stage, stack, seen);
+  stack->pop_back();
+  stage->source += ("#line " + std::to_string(resume_line) + " " + std::to_string(shader_source_number(stage, parent)) + "\n");
+}
+
+static void expand_shader_lines(const std::string &path, Ulong first, Ulong last, ShaderStage *stage, std::vector<std::string> *stack, std::vector<std::string> *seen) {
+  /* References into an unordered_map stay valid as it grows, so `file` survives the includes it parses. */
+  const ParsedShaderFile &file = parse_shader_file(path);
+  for (Ulong i = first; i < last; ++i) {
+    const std::string &line = file.lines[i];
+    std::string dir = directive(line);
+    std::string inc;
+    if (dir.compare(0, 11, "pragma once") == 0) {
+      seen->push_back(path);
+      stage->source += '\n';
+    }
+    else if (dir.compare(0, 7, "version") == 0 && stack->size() > 1) {
+      /* Only the root file may have one, drop it from included ones. */
+      stage->source += '\n';
+    }
+    else if (include_path(dir, path, &inc)) {
+      expand_include(inc, path, (i + 2), stage, stack, seen);
+    }
+    else {
+      stage->source += line;
+      stage->source += '\n';
+    }
+  }
+}
+
+/* Preprocess the shader at `path` into `stage`.  The `#version` and `#extension` lines stay first, then come
+ * `prelude` and the `includes`, as if included there, then the rest of the file.  `#include` is resolved
+ * here, the driver never sees one. */
+ShaderStage preprocess_shader(const char *path, Uint type, const MVector<const char *> &includes, const std::string &prelude) {
+  ShaderStage stage;
+  stage.type = type;
+  stage.files.push_back(path);
+  const ParsedShaderFile &file = parse_shader_file(path);
+  if (!file.found) {
+    LOG_ERROR("Shader %s not found\n", path);
+    return stage;
+  }
+  /* Past the `#version` line and the `#extension` lines after it. */
+  Ulong header = 0;
+  for (Ulong i = 0; i < file.lines.size(); ++i) {
+    std::string dir = directive(file.lines[i]);
+    if (dir.compare(0, 7, "version") == 0) {
+      header = (i + 1);
+    }
+    else if (header && dir.compare(0, 9, "extension") == 0) {
+      header = (i + 1);
+    }
+    else if (header) {
+      break;
+    }
+  }
+  std::vector<std::string> stack = {path};
+  std::vector<std::string> seen;
+  expand_shader_lines(path, 0, header, &stage, &stack, &seen);
+  if (!prelude.empty() || !includes.empty()) {
+    stage.source += prelude;
+    for (const char *inc : includes) {
+      expand_include(inc, path, (header + 1), &stage, &stack, &seen);
+    }
+    stage.source += ("#line " + std::to_string(header + 1) + " 0\n");
+  }
+  expand_shader_lines(path, header, file.lines.size(), &stage, &stack, &seen);
+  return stage;
+}
+
+/* Log an info log one line per record, so long logs are not cut off at the size of a record. */
+static void log_info_log(const char *info_log) {
+  std::stringstream lines(info_log);
+  std::string line;
+  while (std::getline(lines, line)) {
+    LOG_ERROR("  %s\n", line.c_str());
+  }
+}
+
+/* Log the info log of a failed compile, with the source numbers in it named. */
+static void report_shader_error(Uint shader, const ShaderStage &stage) {
+  char info_log[2048];
+  glGetShaderInfoLog(shader, sizeof(info_log), nullptr, info_log);
+  LOG_ERROR("Error compiling shader %s:\n", stage.files[0].c_str());
+  log_info_log(info_log);
+  for (Uint i = 0; i < stage.files.size(); ++i) {
+    LOG_ERROR("  source %u is %s\n", i, stage.files[i].c_str());
+  }
+}
+
+static bool has_gl_extension(const char *name) {
+  int count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (int i = 0; i < count; ++i) {
+    const char *ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+    if (ext && strcmp(ext, name) == 0) {
+      return true;
+    }
   }
-  /* Create shader program. */
-  Uint program = glCreateProgram();
-  /* Attach all shaders to the shader program. */
-  for (const auto &shader : shaders) {
-    glAttachShader(program, shader);
+  return false;
+}
+
+/* Let the driver compile and link on as many threads as it likes, when it can. */
+static void init_parallel_compile(void) {
+  static bool checked = false;
+  if (checked) {
+    return;
+  }
+  checked = true;
+  if (has_gl_extension("GL_KHR_parallel_shader_compile")) {
+    glMaxShaderCompilerThreadsKHR(0xffffffff);
+    parallel_compile = true;
+  }
+  else if (has_gl_extension("GL_ARB_parallel_shader_compile")) {
+    glMaxShaderCompilerThreadsARB(0xffffffff);
+    parallel_compile = true;
+  }
+}
+
+/* Check the compile and link of `pending`, report what failed, and store it in the shader cache when it linked. */
+static void finish_shader_program(const PendingProgram &pending) {
+  for (Uint i = 0; i < pending.shaders.size(); ++i) {
+    int success;
+    glGetShaderiv(pending.shaders[i], GL_COMPILE_STATUS, &success);
+    if (!success) {
+      report_shader_error(pending.shaders[i], pending.stages[i]);
+    }
   }
-  glLinkProgram(program);
-  /* Check for linking errors. */
   int success;
-  glGetProgramiv(program, GL_LINK_STATUS, &success);
+  glGetProgramiv(pending.program, GL_LINK_STATUS, &success);
   if (!success) {
-    char info_log[512];
-    glGetProgramInfoLog(program, 512, nullptr, info_log);
-    fprintf(stderr, "Error linking shader program: %s\n", info_log);
+    char info_log[2048];
+    glGetProgramInfoLog(pending.program, sizeof(info_log), nullptr, info_log);
+    LOG_ERROR("Error linking shader program %s:\n", pending.stages[0].files[0].c_str());
+    log_info_log(info_log);
+  }
+  else {
+    shader_cache().store(pending.key, pending.program);
   }
   /* Delete shaders used to create shader program. */
-  for (const auto &shader : shaders) {
+  for (const auto &shader : pending.shaders) {
     glDeleteShader(shader);
   }
-  return program;
 }
 
-Uint create_comp_shader_program(const char *path) {
-  return create_shader_program({{path, GL_COMPUTE_SHADER}}, {});
-}
\ No newline at end of file
+/* Wait for every program created since the last call, check them, and store them in the shader cache.
+ * Programs are usable right after they are created, the driver finishes them on first use, so this only
+ * has to run before errors are expected to show, and before the cache is reported. */
+void finish_shader_programs(void) {
+  if (pending_programs.empty()) {
+    return;
+  }
+  /* With parallel compile, take them in the order they finish. */
+  Ulong left = pending_programs.size();
+  std::vector<bool> done(pending_programs.size(), false);
+  while (left) {
+    Ulong before = left;
+    for (Ulong i = 0; i < pending_programs.size(); ++i) {
+      if (done[i]) {
+        continue;
+      }
+      int complete = GL_TRUE;
+      if (parallel_compile) {
+        glGetProgramiv(pending_programs[i].program, GL_COMPLETION_STATUS_KHR, &complete);
+      }
+      if (complete) {
+        finish_shader_program(pending_programs[i]);
+        done[i] = true;
+        --left;
+      }
+    }
+    /* Nothing finished this pass, leave the core to the driver's compile threads for a moment. */
+    if (left == before) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  }
+  pending_programs.clear();
+  shader_cache().stats.miss_ms += duration<double, std::milli>(high_resolution_clock::now() - pending_start).count();
+}
+
+/* Create a program from preprocessed stages, from the shader cache when it has an entry for them.
+ * Otherwise every stage is compiled and the program linked without waiting for either, so the driver
+ * works on all programs created before the next `finish_shader_programs()` at once. */
+Uint build_shader_program(const std::vector<ShaderStage> &stages, const MVector<const char *> &includes) {
+  ShaderCache &cache = shader_cache();
+  time_point start = high_resolution_clock::now();
+  Ulong key = cache.key(stages, includes);
+  Uint program = cache.load(key);
+  if (program) {
+    ++cache.stats.hits;
+    cache.stats.hit_ms += duration<double, std::milli>(high_resolution_clock::now() - start).count();
+    return program;
+  }
+  init_parallel_compile();
+  if (pending_programs.empty()) {
+    pending_start = start;
+  }
+  PendingProgram pending = {glCreateProgram(), {}, stages, key};
+  if (cache.wants_binary()) {
+    glProgramParameteri(pending.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+  for (const auto &stage : stages) {
+    const char *source = stage.source.c_str();
+    Uint shader = glCreateShader(stage.type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+    glAttachShader(pending.program, shader);
+    pending.shaders.push_back(shader);
+  }
+  glLinkProgram(pending.program);
+  pending_programs.push_back(pending);
+  ++cache.stats.misses;
+  return pending.program;
+}
+
+Uint create_shader_program(const MVector<Pair<const char *, Uint>> &parts, const MVector<const char *> &includes) {
+  /* Load shaders. */
+  std::vector<ShaderStage> stages;
+  for (const auto &pair : parts) {
+    stages.push_back(preprocess_shader(pair.first, pair.second, includes, ""));
+  }
+  return build_shader_program(stages, includes);
+}
+
+/* Create a render program whose vertex stages read the body buffers, the body layout of body_layout.h
+ * is declared in every vertex stage with the aos layout, or the soa layout when `soa` is set.  `soa` has
+ * to match the compute program that writes the bodies, see `ComputeObject::soa_layout()`. */
+Uint create_body_shader_program(const MVector<Pair<const char *, Uint>> &parts, bool soa) {
+  std::vector<ShaderStage> stages;
+  for (const auto &pair : parts) {
+    stages.push_back(preprocess_shader(pair.first, pair.second, {}, ((pair.second == GL_VERTEX_SHADER) ? body_layout_glsl(soa) : "")));
+  }
+  return build_shader_program(stages, {});
+}
+
+/* Whether the driver has enough storage buffer bindings for the soa body layout, `create_comp_shader_program()`
+ * falls back to the aos layout when it does not. */
+bool body_soa_supported(void) {
+  int max_bindings;
+  glGetIntegerv(GL_MAX_SHADER_STORAGE_BUFFER_BINDINGS, &max_bindings);
+  return ((BODY_SOA_BINDING + (BODY_SET_COUNT * BODY_MAX_FIELDS)) <= (Uint)max_bindings);
+}
+
+/* Create a compute program with a workgroup size of `local_size`, clamped to what the driver supports.  The
+ * body buffers are declared with the aos layout, or the soa layout when `soa` is set, see body_layout.h. */
+Uint create_comp_shader_program(const char *path, Uint local_size, bool soa) {
+  int max_size;
+  int max_invocations;
+  glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &max_size);
+  glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+  Uint limit = (Uint)glm::min(max_size, max_invocations);
+  if (local_size < 1 || local_size > limit) {
+    Uint clamped = ((local_size < 1) ? 1 : limit);
+    LOG_WARN("Compute workgroup size %u is out of range [1, %u], using %u\n", local_size, limit, clamped);
+    local_size = clamped;
+  }
+  if (soa && !body_soa_supported()) {
+    LOG_WARN("The soa body layout needs %u storage buffer bindings, which the driver does not support, using aos\n",
+      (BODY_SOA_BINDING + (BODY_SET_COUNT * BODY_MAX_FIELDS)));
+    soa = false;
+  }
+  std::string prelude = ("#define COMPUTE_LOCAL_SIZE " + std::to_string(local_size) + "\n" + body_layout_glsl(soa));
+  return build_shader_program({preprocess_shader(path, GL_COMPUTE_SHADER, {}, prelude)}, {});
+}
@@ -9,14 +9,14 @@ void init_projection(GameObject *game, float fov, float aspect_ratio, float znea
 /* Initialize SDL and set all GL attribute pair`s. */
 void init_SDL(const MVector<Pair<SDL_GLattr, int>> &gl_attributes) {
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-    fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+    LOG_ERROR("Failed to initialize SDL: %s\n", SDL_GetError());
     exit(SDL_INIT_ERROR);
   }
   /* Set all attribute pairs. */
   for (const auto &attr : gl_attributes) {
     /* If an attribute failes to be set, print the error, then terminate imedietly. */
     if (SDL_GL_SetAttribute(attr.first, attr.second) != 0) {
-      fprintf(stderr, "Failed to set attr: %s\n", SDL_GetError());
+      LOG_ERROR("Failed to set attr: %s\n", SDL_GetError());
       SDL_Quit();
       exit(SDL_SET_ATTR_ERROR);
     }
@@ -44,7 +44,7 @@ void init_SDL_window(GameObject *game, const char *title, int *data) {
   game->win = SDL_CreateWindow(!title ? "placeholder" : title, opt[0], opt[1], opt[2], opt[3], opt[4]);
   /* Terminate apon failure. */
   if (!game->win) {
-    fprintf(stderr, "Failed to create window: %s\n", SDL_GetError());
+    LOG_ERROR("Failed to create window: %s\n", SDL_GetError());
     SDL_Quit();
     exit(SDL_WINDOW_CREATION_ERROR);
   }
@@ -59,14 +59,14 @@ void init_SDL_window(GameObject *game, const char *title, int *data) {
 void create_SDL_GLContext_and_init_glew(GameObject *game) {
   game->context = SDL_GL_CreateContext(game->win);
   if (!game->context) {
-    fprintf(stderr, "Failed to create OpenGL context: %s\n", SDL_GetError());
+    LOG_ERROR("Failed to create OpenGL context: %s\n", SDL_GetError());
     SDL_DestroyWindow(game->win);
     SDL_Quit();
     exit(SDL_GLCONTEXT_CREATION_ERROR);
   }
   glewExperimental = GL_TRUE;
   if (glewInit() != GLEW_OK) {
-    fprintf(stderr, "Failed to initialize glew\n");
+    LOG_ERROR("Failed to initialize glew\n");
     SDL_GL_DeleteContext(game->context);
     SDL_DestroyWindow(game->win);
     SDL_Quit();
@@ -77,6 +77,10 @@ void create_SDL_GLContext_and_init_glew(GameObject *game) {
 /* Cleanup before exit. */
 void cleanup(GameObject *game) {
   glDeleteProgram(game->shader_program);
+  glDeleteProgram(game->instanced_program);
+  geometry_arena().release();
+  game->frame.release();
+  profiler().release();
   SDL_GL_DeleteContext(game->context);
   SDL_DestroyWindow(game->win);
   SDL_Quit();
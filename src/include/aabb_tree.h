@@ -0,0 +1,426 @@
+#pragma once
+
+/* clang-format off */
+
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+#include <Mlib/Vector.h>
+
+/* Dynamic aabb tree for scene queries.  Every leaf holds a fat box around the real bounds, so a proxy
+ * that moves a little stays where it is, and only a proxy that leaves its fat box is taken out and put
+ * back in.  Insertions pick the sibling that grows the tree's surface area the least, and the tree is
+ * kept balanced with rotations, so overlap, raycast and nearest queries are O(log n). */
+
+/* How far a fat box reaches past the real bounds on every side. */
+#define AABB_TREE_MARGIN 0.1f
+/* How many frames of movement a fat box is stretched ahead by, along the displacement. */
+#define AABB_TREE_PREDICT 2.0f
+
+#define AABB_NULL_NODE (-1)
+
+typedef struct {
+  vec3 min;
+  vec3 max;
+} Aabb;
+
+__INLINE_NAMESPACE(AabbTools) {
+  /* Box around center `pos` with full extent `size`, the same layout the `MESH_` macros use. */
+  inline Aabb aabb_from_box(const vec3 &pos, const vec3 &size) {
+    return {(pos - (size * 0.5f)), (pos + (size * 0.5f))};
+  }
+
+  inline vec3 aabb_center(const Aabb &a) {
+    return ((a.min + a.max) * 0.5f);
+  }
+
+  inline vec3 aabb_size(const Aabb &a) {
+    return (a.max - a.min);
+  }
+
+  inline Aabb aabb_union(const Aabb &a, const Aabb &b) {
+    return {
+      {fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z)},
+      {fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z)}
+    };
+  }
+
+  /* Half the surface area, only ever compared against other areas. */
+  inline float aabb_area(const Aabb &a) {
+    vec3 d = (a.max - a.min);
+    return ((d.x * d.y) + (d.y * d.z) + (d.z * d.x));
+  }
+
+  inline bool aabb_overlap(const Aabb &a, const Aabb &b) {
+    return (a.max.x >= b.min.x && a.min.x <= b.max.x &&
+            a.max.y >= b.min.y && a.min.y <= b.max.y &&
+            a.max.z >= b.min.z && a.min.z <= b.max.z);
+  }
+
+  inline bool aabb_contains(const Aabb &outer, const Aabb &inner) {
+    return (outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+            outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z);
+  }
+
+  /* Squared distance from `p` to the closest point of `a`, 0 when inside. */
+  inline float aabb_distance2(const Aabb &a, const vec3 &p) {
+    float dist2 = 0.0f;
+    for (Uint c = 0; c < 3; ++c) {
+      float d = fmaxf(fmaxf((a.min[c] - p[c]), 0.0f), (p[c] - a.max[c]));
+      dist2 += (d * d);
+    }
+    return dist2;
+  }
+
+  /* Slab test, `inv_dir` is 1 / ray direction.  On a hit within [0, `max_t`], `*t` is set to the entry
+   * distance, or 0 when the ray starts inside. */
+  inline bool aabb_raycast(const Aabb &a, const vec3 &origin, const vec3 &inv_dir, float max_t, float *t) {
+    float t_min = 0.0f;
+    float t_max = max_t;
+    for (Uint c = 0; c < 3; ++c) {
+      /* Parallel to the slab, `inv_dir` is infinite, and starting on the boundary would give 0 * inf = nan,
+       * which `fminf()` and `fmaxf()` drop.  The ray is in the slab for good or never, the box is closed. */
+      if (isinf(inv_dir[c])) {
+        if (origin[c] < a.min[c] || origin[c] > a.max[c]) {
+          return false;
+        }
+        continue;
+      }
+      float t0 = ((a.min[c] - origin[c]) * inv_dir[c]);
+      float t1 = ((a.max[c] - origin[c]) * inv_dir[c]);
+      t_min = fmaxf(t_min, fminf(t0, t1));
+      t_max = fminf(t_max, fmaxf(t0, t1));
+      if (t_min > t_max) {
+        return false;
+      }
+    }
+    *t = t_min;
+    return true;
+  }
+}
+
+class AabbTree {
+ private:
+  typedef struct {
+    /* Fat box for leaves, union of both children otherwise. */
+    Aabb box;
+    /* Real bounds, only set for leaves. */
+    Aabb tight;
+    void *data;
+    /* Next free node while on the free list. */
+    int parent;
+    int left;
+    int right;
+    /* 0 for leaves, -1 while free. */
+    int height;
+  } Node;
+
+  MVector<Node> nodes;
+  int root = AABB_NULL_NODE;
+  int free_list = AABB_NULL_NODE;
+  Uint leaf_count = 0;
+  /* Traversal stack, reused by every query so they never allocate. */
+  MVector<int> stack;
+
+  bool is_leaf(int n) const {
+    return (nodes[n].left == AABB_NULL_NODE);
+  }
+
+  int alloc_node(void) {
+    if (free_list == AABB_NULL_NODE) {
+      Node node;
+      node.parent = AABB_NULL_NODE;
+      node.height = -1;
+      nodes.push_back(node);
+      free_list = (nodes.size() - 1);
+    }
+    int n = free_list;
+    free_list = nodes[n].parent;
+    nodes[n].parent = AABB_NULL_NODE;
+    nodes[n].left   = AABB_NULL_NODE;
+    nodes[n].right  = AABB_NULL_NODE;
+    nodes[n].height = 0;
+    nodes[n].data   = nullptr;
+    return n;
+  }
+
+  void free_node(int n) {
+    nodes[n].parent = free_list;
+    nodes[n].height = -1;
+    free_list = n;
+  }
+
+  /* Refit boxes and heights from `n` up to the root, rebalancing on the way. */
+  void refit(int n) {
+    while (n != AABB_NULL_NODE) {
+      n = balance(n);
+      int l = nodes[n].left;
+      int r = nodes[n].right;
+      nodes[n].height = (1 + std::max(nodes[l].height, nodes[r].height));
+      nodes[n].box    = aabb_union(nodes[l].box, nodes[r].box);
+      n = nodes[n].parent;
+    }
+  }
+
+  /* Swap `child` into the place of its parent `a`, and `a` down into the place of `child`'s shorter child. */
+  int rotate(int a, int child, int other) {
+    int f = nodes[child].left;
+    int g = nodes[child].right;
+    nodes[child].left   = a;
+    nodes[child].parent = nodes[a].parent;
+    nodes[a].parent     = child;
+    if (nodes[child].parent != AABB_NULL_NODE) {
+      Node &p = nodes[nodes[child].parent];
+      ((p.left == a) ? p.left : p.right) = child;
+    }
+    else {
+      root = child;
+    }
+    int keep = ((nodes[f].height > nodes[g].height) ? f : g);
+    int move = ((keep == f) ? g : f);
+    nodes[child].right = keep;
+    ((nodes[a].left == child) ? nodes[a].left : nodes[a].right) = move;
+    nodes[move].parent = a;
+    nodes[a].box       = aabb_union(nodes[other].box, nodes[move].box);
+    nodes[child].box   = aabb_union(nodes[a].box, nodes[keep].box);
+    nodes[a].height     = (1 + std::max(nodes[other].height, nodes[move].height));
+    nodes[child].height = (1 + std::max(nodes[a].height, nodes[keep].height));
+    return child;
+  }
+
+  /* Rotate `a` when one side is more than one level taller, returns the node now in its place. */
+  int balance(int a) {
+    if (is_leaf(a) || nodes[a].height < 2) {
+      return a;
+    }
+    int b = nodes[a].left;
+    int c = nodes[a].right;
+    int diff = (nodes[c].height - nodes[b].height);
+    if (diff > 1) {
+      return rotate(a, c, b);
+    }
+    if (diff < -1) {
+      return rotate(a, b, c);
+    }
+    return a;
+  }
+
+  void insert_leaf(int leaf) {
+    if (root == AABB_NULL_NODE) {
+      root = leaf;
+      nodes[root].parent = AABB_NULL_NODE;
+      return;
+    }
+    /* Walk down to the sibling that grows the total area the least. */
+    const Aabb box = nodes[leaf].box;
+    int n = root;
+    while (!is_leaf(n)) {
+      int l = nodes[n].left;
+      int r = nodes[n].right;
+      float area     = aabb_area(nodes[n].box);
+      float combined = aabb_area(aabb_union(nodes[n].box, box));
+      /* Cost of making a new parent for `n` and `leaf`, and the least cost pushed down to any child. */
+      float cost    = (2.0f * combined);
+      float inherit = (2.0f * (combined - area));
+      float cost_l = (aabb_area(aabb_union(box, nodes[l].box)) + inherit);
+      float cost_r = (aabb_area(aabb_union(box, nodes[r].box)) + inherit);
+      if (!is_leaf(l)) {
+        cost_l -= aabb_area(nodes[l].box);
+      }
+      if (!is_leaf(r)) {
+        cost_r -= aabb_area(nodes[r].box);
+      }
+      if (cost < cost_l && cost < cost_r) {
+        break;
+      }
+      n = ((cost_l < cost_r) ? l : r);
+    }
+    int old_parent = nodes[n].parent;
+    int parent = alloc_node();
+    nodes[parent].parent = old_parent;
+    nodes[parent].left   = n;
+    nodes[parent].right  = leaf;
+    nodes[parent].box    = aabb_union(box, nodes[n].box);
+    nodes[parent].height = (nodes[n].height + 1);
+    nodes[n].parent    = parent;
+    nodes[leaf].parent = parent;
+    if (old_parent != AABB_NULL_NODE) {
+      ((nodes[old_parent].left == n) ? nodes[old_parent].left : nodes[old_parent].right) = parent;
+    }
+    else {
+      root = parent;
+    }
+    refit(nodes[leaf].parent);
+  }
+
+  void remove_leaf(int leaf) {
+    if (leaf == root) {
+      root = AABB_NULL_NODE;
+      return;
+    }
+    int parent  = nodes[leaf].parent;
+    int grand   = nodes[parent].parent;
+    int sibling = ((nodes[parent].left == leaf) ? nodes[parent].right : nodes[parent].left);
+    nodes[sibling].parent = grand;
+    if (grand != AABB_NULL_NODE) {
+      ((nodes[grand].left == parent) ? nodes[grand].left : nodes[grand].right) = sibling;
+      refit(grand);
+    }
+    else {
+      root = sibling;
+    }
+    free_node(parent);
+  }
+
+  static Aabb fatten(const Aabb &box, const vec3 &displacement) {
+    Aabb fat = {(box.min - vec3(AABB_TREE_MARGIN)), (box.max + vec3(AABB_TREE_MARGIN))};
+    for (Uint c = 0; c < 3; ++c) {
+      float d = (displacement[c] * AABB_TREE_PREDICT);
+      ((d < 0.0f) ? fat.min[c] : fat.max[c]) += d;
+    }
+    return fat;
+  }
+
+ public:
+  /* Add a proxy for `box`, `data` is handed back by every query that finds it. */
+  int insert(const Aabb &box, void *data) {
+    int leaf = alloc_node();
+    nodes[leaf].box   = fatten(box, vec3(0.0f));
+    nodes[leaf].tight = box;
+    nodes[leaf].data  = data;
+    insert_leaf(leaf);
+    ++leaf_count;
+    return leaf;
+  }
+
+  void remove(int proxy) {
+    remove_leaf(proxy);
+    free_node(proxy);
+    --leaf_count;
+  }
+
+  /* Update the bounds of `proxy`, `displacement` is how far it moved since the last update.  Returns true
+   * when the proxy left its fat box and was reinserted, otherwise the tree is left as is. */
+  bool move(int proxy, const Aabb &box, const vec3 &displacement = vec3(0.0f)) {
+    nodes[proxy].tight = box;
+    if (aabb_contains(nodes[proxy].box, box)) {
+      return false;
+    }
+    remove_leaf(proxy);
+    nodes[proxy].box = fatten(box, displacement);
+    insert_leaf(proxy);
+    return true;
+  }
+
+  void *user_data(int proxy) const {
+    return nodes[proxy].data;
+  }
+
+  const Aabb &bounds(int proxy) const {
+    return nodes[proxy].tight;
+  }
+
+  Uint size(void) const {
+    return leaf_count;
+  }
+
+  /* Height of the tree, 0 for a single leaf, -1 when empty. */
+  int height(void) const {
+    return ((root == AABB_NULL_NODE) ? -1 : nodes[root].height);
+  }
+
+  /* Call `fn(proxy)` for every proxy whose real bounds overlap `box`.  `fn` returns false to stop early. */
+  template <typename F>
+  void query(const Aabb &box, F &&fn) {
+    if (root == AABB_NULL_NODE) {
+      return;
+    }
+    stack.clear();
+    stack.push_back(root);
+    while (!stack.empty()) {
+      int n = stack.back();
+      stack.pop_back();
+      if (!aabb_overlap(nodes[n].box, box)) {
+        continue;
+      }
+      if (is_leaf(n)) {
+        if (aabb_overlap(nodes[n].tight, box) && !fn(n)) {
+          return;
+        }
+      }
+      else {
+        stack.push_back(nodes[n].left);
+        stack.push_back(nodes[n].right);
+      }
+    }
+  }
+
+  /* Closest proxy hit by the ray from `origin` along `dir` within `max_t`, or `AABB_NULL_NODE`.  `*hit_t`
+   * is set to the distance along `dir` to the hit. */
+  int raycast(const vec3 &origin, const vec3 &dir, float max_t, float *hit_t = nullptr) {
+    int best = AABB_NULL_NODE;
+    if (root == AABB_NULL_NODE) {
+      return best;
+    }
+    const vec3 inv_dir((1.0f / dir.x), (1.0f / dir.y), (1.0f / dir.z));
+    float t;
+    stack.clear();
+    stack.push_back(root);
+    while (!stack.empty()) {
+      int n = stack.back();
+      stack.pop_back();
+      /* Every hit shortens the ray, so the rest of the tree is culled harder as the search goes on. */
+      if (!aabb_raycast(nodes[n].box, origin, inv_dir, max_t, &t)) {
+        continue;
+      }
+      if (is_leaf(n)) {
+        if (aabb_raycast(nodes[n].tight, origin, inv_dir, max_t, &t)) {
+          max_t = t;
+          best  = n;
+        }
+      }
+      else {
+        stack.push_back(nodes[n].left);
+        stack.push_back(nodes[n].right);
+      }
+    }
+    if (hit_t && best != AABB_NULL_NODE) {
+      *hit_t = max_t;
+    }
+    return best;
+  }
+
+  /* Proxy whose real bounds are closest to `point` within `max_dist`, or `AABB_NULL_NODE`. */
+  int nearest(const vec3 &point, float max_dist = FLT_MAX) {
+    int best = AABB_NULL_NODE;
+    if (root == AABB_NULL_NODE) {
+      return best;
+    }
+    float best_dist2 = ((max_dist < FLT_MAX) ? (max_dist * max_dist) : FLT_MAX);
+    stack.clear();
+    stack.push_back(root);
+    while (!stack.empty()) {
+      int n = stack.back();
+      stack.pop_back();
+      if (aabb_distance2(nodes[n].box, point) > best_dist2) {
+        continue;
+      }
+      if (is_leaf(n)) {
+        float dist2 = aabb_distance2(nodes[n].tight, point);
+        if (dist2 <= best_dist2) {
+          best_dist2 = dist2;
+          best = n;
+        }
+        continue;
+      }
+      /* Push the closer child last, so it is searched first and prunes the other one. */
+      int l = nodes[n].left;
+      int r = nodes[n].right;
+      bool l_closer = (aabb_distance2(nodes[l].box, point) < aabb_distance2(nodes[r].box, point));
+      stack.push_back(l_closer ? r : l);
+      stack.push_back(l_closer ? l : r);
+    }
+    return best;
+  }
+};
@@ -0,0 +1,224 @@
+#pragma once
+
+/* clang-format off */
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+/* Packed gpu layout of the bodies.  The field lists below are the single definition of the layout, the
+ * C++ structs here and the GLSL structs, buffers and accessors of shader.comp are both generated from
+ * them, see `body_layout_glsl()`.
+ *
+ * The state written every step is two vec4s, 32 bytes, down from the 80 byte `ComputeData`.  Size and
+ * acceleration only change when the scene does, so they live in a read-only buffer that is uploaded once. */
+
+/* Position and bounding sphere radius, velocity and flags.  `vel_flags.w` holds `flags[0]` in the low
+ * 16 bits and the sleep counter in the 8 above, stored as a float so it is always exact. */
+#define BODY_STATE_FIELDS(X) \
+  X(vec4, pos_radius)        \
+  X(vec4, vel_flags)
+
+/* Full extent, and constant acceleration. */
+#define BODY_STATIC_FIELDS(X) \
+  X(vec4, size)               \
+  X(vec4, accel)
+
+#define BODY_MAX_FIELDS 4
+
+/* Buffer bindings of the aos layout, the other bindings below 8 belong to the broad phase and wake buffers.
+ * In soa mode every field has its own buffer, set `s` field `k` is bound at `BODY_SOA_BINDING + s * BODY_MAX_FIELDS + k`. */
+#define BODY_IN_BINDING     1
+#define BODY_OUT_BINDING    5
+#define BODY_STATIC_BINDING 7
+#define BODY_SOA_BINDING    8
+
+#define __BODY_STRUCT_FIELD(type, name) type name;
+
+typedef struct {
+  BODY_STATE_FIELDS(__BODY_STRUCT_FIELD)
+} BodyState;
+
+typedef struct {
+  BODY_STATIC_FIELDS(__BODY_STRUCT_FIELD)
+} BodyStatic;
+
+/* Only vec4 members, so the std430 layout has no padding. */
+static_assert((sizeof(BodyState) == 32 && sizeof(BodyStatic) == 32), "Body structs must match their std430 layout");
+
+typedef struct {
+  const char *type;
+  const char *name;
+  Uint offset;
+  Uint size;
+} BodyField;
+
+#define __BODY_STATE_FIELD_DESC(type, name)  {#type, #name, (Uint)offsetof(BodyState, name), (Uint)sizeof(type)},
+#define __BODY_STATIC_FIELD_DESC(type, name) {#type, #name, (Uint)offsetof(BodyStatic, name), (Uint)sizeof(type)},
+
+static __inline__ constexpr BodyField body_state_fields[]  = {BODY_STATE_FIELDS(__BODY_STATE_FIELD_DESC)};
+static __inline__ constexpr BodyField body_static_fields[] = {BODY_STATIC_FIELDS(__BODY_STATIC_FIELD_DESC)};
+
+/* The three sets of body buffers, the state, the output of FUSED_OPERATION, and the read-only part. */
+enum BodySet {
+  BODY_SET_IN,
+  BODY_SET_OUT,
+  BODY_SET_STATIC,
+  BODY_SET_COUNT
+};
+
+typedef struct {
+  /* GLSL block name, and the array name in it. */
+  const char *block;
+  const char *array;
+  const char *type;
+  const BodyField *fields;
+  Uint field_count;
+  Uint stride;
+  Uint binding;
+  bool readonly;
+} BodyBufferSet;
+
+static __inline__ constexpr BodyBufferSet body_sets[BODY_SET_COUNT] = {
+  {"BodyStateIn",  "body_in",     "BodyState",  body_state_fields,  (sizeof(body_state_fields) / sizeof(BodyField)),  sizeof(BodyState),  BODY_IN_BINDING,     false},
+  {"BodyStateOut", "body_out",    "BodyState",  body_state_fields,  (sizeof(body_state_fields) / sizeof(BodyField)),  sizeof(BodyState),  BODY_OUT_BINDING,    false},
+  {"BodyStaticIn", "body_static", "BodyStatic", body_static_fields, (sizeof(body_static_fields) / sizeof(BodyField)), sizeof(BodyStatic), BODY_STATIC_BINDING, true}
+};
+
+static_assert((sizeof(body_state_fields) / sizeof(BodyField)) <= BODY_MAX_FIELDS, "Too many body state fields");
+static_assert((sizeof(body_static_fields) / sizeof(BodyField)) <= BODY_MAX_FIELDS, "Too many static body fields");
+
+__INLINE_NAMESPACE(BodyLayout) {
+  /* Number of buffers backing `set`, one for the whole struct, or one per field in soa mode. */
+  inline Uint body_buffer_count(BodySet set, bool soa) {
+    return (soa ? body_sets[set].field_count : 1);
+  }
+
+  /* Bytes per body in buffer `k` of `set`. */
+  inline Uint body_buffer_stride(BodySet set, bool soa, Uint k) {
+    return (soa ? body_sets[set].fields[k].size : body_sets[set].stride);
+  }
+
+  inline Uint body_buffer_binding(BodySet set, bool soa, Uint k) {
+    return (soa ? (BODY_SOA_BINDING + (set * BODY_MAX_FIELDS) + k) : body_sets[set].binding);
+  }
+
+  /* Copy `count` structs from `src` into the buffers `dst` of `set`, each already offset to the first body. */
+  inline void scatter_bodies(BodySet set, bool soa, const void *src, Uint count, Uchar *const *dst) {
+    const BodyBufferSet &s = body_sets[set];
+    if (!soa) {
+      memcpy(dst[0], src, (count * s.stride));
+      return;
+    }
+    for (Uint k = 0; k < s.field_count; ++k) {
+      const BodyField &f = s.fields[k];
+      for (Uint i = 0; i < count; ++i) {
+        memcpy((dst[k] + (i * f.size)), ((const Uchar *)src + (i * s.stride) + f.offset), f.size);
+      }
+    }
+  }
+
+  /* The reverse of `scatter_bodies()`. */
+  inline void gather_bodies(BodySet set, bool soa, const Uchar *const *src, Uint count, void *dst) {
+    const BodyBufferSet &s = body_sets[set];
+    if (!soa) {
+      memcpy(dst, src[0], (count * s.stride));
+      return;
+    }
+    for (Uint k = 0; k < s.field_count; ++k) {
+      const BodyField &f = s.fields[k];
+      for (Uint i = 0; i < count; ++i) {
+        memcpy(((Uchar *)dst + (i * s.stride) + f.offset), (src[k] + (i * f.size)), f.size);
+      }
+    }
+  }
+
+  /* Must match `pack_body()` in shader.comp. */
+  inline BodyState pack_state(const ComputeData &cd) {
+    float radius = (0.5f * sqrtf((cd.size.x * cd.size.x) + (cd.size.y * cd.size.y) + (cd.size.z * cd.size.z)));
+    int counter  = ((cd.flags[1] < 0xff) ? cd.flags[1] : 0xff);
+    BodyState s;
+    s.pos_radius = vec4(cd.pos.x, cd.pos.y, cd.pos.z, radius);
+    s.vel_flags  = vec4(cd.vel.x, cd.vel.y, cd.vel.z, (float)((cd.flags[0] & 0xffff) | (counter << 16)));
+    return s;
+  }
+
+  /* Must match `load_body()` in shader.comp. */
+  inline void unpack_state(const BodyState &s, ComputeData *cd) {
+    int bits = (int)s.vel_flags.w;
+    cd->pos = vec3(s.pos_radius.x, s.pos_radius.y, s.pos_radius.z);
+    cd->vel = vec3(s.vel_flags.x, s.vel_flags.y, s.vel_flags.z);
+    cd->flags[0] = (bits & 0xffff);
+    cd->flags[1] = (bits >> 16);
+  }
+
+  /* Static bodies never accelerate. */
+  inline BodyStatic pack_static(const ComputeData &cd) {
+    bool is_static = (cd.flags[0] & (1 << STATIC_MESH));
+    BodyStatic s;
+    s.size  = vec4(cd.size.x, cd.size.y, cd.size.z, 0.0f);
+    s.accel = (is_static ? vec4(0.0f, 0.0f, 0.0f, 0.0f) : vec4(cd.accel.x, cd.accel.y, cd.accel.z, 0.0f));
+    return s;
+  }
+
+  /* GLSL declarations of the body structs and buffers, and the accessors shader.comp uses to reach them:
+   * `load_state()`, `store_state()`, `store_state_out()`, `load_static()` and `body_count()`. */
+  inline std::string body_layout_glsl(bool soa) {
+    std::string glsl;
+    const char *types[2] = {"BodyState", "BodyStatic"};
+    const BodySet type_sets[2] = {BODY_SET_IN, BODY_SET_STATIC};
+    for (Uint t = 0; t < 2; ++t) {
+      glsl += ("struct " + std::string(types[t]) + " {\n");
+      for (Uint k = 0; k < body_sets[type_sets[t]].field_count; ++k) {
+        glsl += ("  " + std::string(body_sets[type_sets[t]].fields[k].type) + " " + body_sets[type_sets[t]].fields[k].name + ";\n");
+      }
+      glsl += "};\n";
+    }
+    for (Uint set = 0; set < BODY_SET_COUNT; ++set) {
+      const BodyBufferSet &s = body_sets[set];
+      std::string qualifier = (s.readonly ? "readonly buffer " : "buffer ");
+      if (!soa) {
+        glsl += ("layout(std430, binding = " + std::to_string(s.binding) + ") " + qualifier + s.block + " { " + s.type + " " + s.array + "[]; };\n");
+        continue;
+      }
+      for (Uint k = 0; k < s.field_count; ++k) {
+        glsl += ("layout(std430, binding = " + std::to_string(body_buffer_binding((BodySet)set, true, k)) + ") " + qualifier +
+                 s.block + "_" + s.fields[k].name + " { " + s.fields[k].type + " " + s.array + "_" + s.fields[k].name + "[]; };\n");
+      }
+    }
+    /* Accessors, so the rest of the shader never depends on the layout. */
+    auto load = [&](BodySet set, const char *fn) {
+      const BodyBufferSet &s = body_sets[set];
+      glsl += (std::string(s.type) + " " + fn + "(uint i) { ");
+      if (!soa) {
+        glsl += ("return " + std::string(s.array) + "[i]; }\n");
+        return;
+      }
+      glsl += (std::string(s.type) + " b; ");
+      for (Uint k = 0; k < s.field_count; ++k) {
+        glsl += ("b." + std::string(s.fields[k].name) + " = " + s.array + "_" + s.fields[k].name + "[i]; ");
+      }
+      glsl += "return b; }\n";
+    };
+    auto store = [&](BodySet set, const char *fn) {
+      const BodyBufferSet &s = body_sets[set];
+      glsl += ("void " + std::string(fn) + "(uint i, " + s.type + " b) { ");
+      if (!soa) {
+        glsl += (std::string(s.array) + "[i] = b; }\n");
+        return;
+      }
+      for (Uint k = 0; k < s.field_count; ++k) {
+        glsl += (std::string(s.array) + "_" + s.fields[k].name + "[i] = b." + s.fields[k].name + "; ");
+      }
+      glsl += "}\n";
+    };
+    load(BODY_SET_IN, "load_state");
+    store(BODY_SET_IN, "store_state");
+    store(BODY_SET_OUT, "store_state_out");
+    load(BODY_SET_STATIC, "load_static");
+    glsl += ("uint body_count() { return uint(" + std::string(body_sets[BODY_SET_IN].array) +
+             (soa ? ("_" + std::string(body_sets[BODY_SET_IN].fields[0].name)) : "") + ".length()); }\n");
+    return glsl;
+  }
+}
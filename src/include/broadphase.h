@@ -0,0 +1,151 @@
+#pragma once
+
+/* clang-format off */
+
+#include "def.h"
+
+/* Cpu reference for the spatial hash broad phase in shader.comp.  Everything here mirrors the gpu
+ * passes exactly, so the results of the grid can be checked against the brute-force O(n^2) scan. */
+
+#define GRID_TABLE_SIZE 4096
+
+__INLINE_NAMESPACE(Broadphase) {
+  /* Must match `grid_cell()` in shader.comp. */
+  inline glm::ivec3 grid_cell(const vec3 &pos, float cell_size) {
+    return glm::ivec3(floorf(pos.x / cell_size), floorf(pos.y / cell_size), floorf(pos.z / cell_size));
+  }
+
+  /* Must match `grid_hash()` in shader.comp. */
+  __INLINE_CONSTEXPR(Uint) grid_hash(const glm::ivec3 &cell, Uint table_size) {
+    return ((((Uint)cell.x * 73856093u) ^ ((Uint)cell.y * 19349663u) ^ ((Uint)cell.z * 83492791u)) % table_size);
+  }
+
+  /* The smallest cell size that still guarantees that two overlapping bodies land in neighbouring cells. */
+  inline float grid_cell_size(const MVector<ComputeData> &data) {
+    float cell_size = 0.0f;
+    for (const auto &cd : data) {
+      cell_size = glm::max(cell_size, glm::max(cd.size.x, glm::max(cd.size.y, cd.size.z)));
+    }
+    return ((cell_size > 0.0f) ? cell_size : 1.0f);
+  }
+
+  typedef struct {
+    /* `table_size + 1` entries, cell `h` spans [start[h], start[h + 1]) in `bodies`. */
+    MVector<Uint> start;
+    MVector<Uint> bodies;
+  } BroadphaseGrid;
+
+  /* Counting sort of all bodies into their cells, the same count, scan, scatter passes the gpu runs. */
+  inline void build_grid(BroadphaseGrid *grid, const MVector<ComputeData> &data, float cell_size, Uint table_size) {
+    MVector<Uint> count;
+    count.resize(table_size);
+    for (Uint i = 0; i < table_size; ++i) {
+      count[i] = 0;
+    }
+    for (const auto &cd : data) {
+      ++count[grid_hash(grid_cell(cd.pos, cell_size), table_size)];
+    }
+    grid->start.resize(table_size + 1);
+    Uint sum = 0;
+    for (Uint i = 0; i < table_size; ++i) {
+      grid->start[i] = sum;
+      sum += count[i];
+      count[i] = 0;
+    }
+    grid->start[table_size] = sum;
+    grid->bodies.resize(data.size());
+    for (Uint i = 0; i < data.size(); ++i) {
+      Uint h = grid_hash(grid_cell(data[i].pos, cell_size), table_size);
+      grid->bodies[grid->start[h] + count[h]++] = i;
+    }
+  }
+
+  /* Every colliding pair (i < j), found by testing all bodies against each other. */
+  inline void brute_force_pairs(MVector<Pair<Uint, Uint>> *pairs, const MVector<ComputeData> &data) {
+    for (Uint i = 0; i < data.size(); ++i) {
+      for (Uint j = (i + 1); j < data.size(); ++j) {
+        if (MESH_COLLIDING(&data[i], &data[j])) {
+          pairs->push_back({i, j});
+        }
+      }
+    }
+  }
+
+  /* Every colliding pair (i < j), found by only testing bodies in neighbouring cells. */
+  inline void grid_pairs(MVector<Pair<Uint, Uint>> *pairs, const MVector<ComputeData> &data, const BroadphaseGrid &grid, float cell_size) {
+    const Uint table_size = (grid.start.size() - 1);
+    for (Uint idx = 0; idx < data.size(); ++idx) {
+      glm::ivec3 cell = grid_cell(data[idx].pos, cell_size);
+      Uint visited[27];
+      Uint visited_count = 0;
+      for (int z = -1; z <= 1; ++z) {
+        for (int y = -1; y <= 1; ++y) {
+          for (int x = -1; x <= 1; ++x) {
+            Uint h = grid_hash((cell + glm::ivec3(x, y, z)), table_size);
+            bool seen = false;
+            for (Uint v = 0; v < visited_count; ++v) {
+              seen |= (visited[v] == h);
+            }
+            if (seen) {
+              continue;
+            }
+            visited[visited_count++] = h;
+            for (Uint s = grid.start[h]; s < grid.start[h + 1]; ++s) {
+              Uint i = grid.bodies[s];
+              if (i > idx && MESH_COLLIDING(&data[idx], &data[i])) {
+                pairs->push_back({idx, i});
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /* Returns the number of colliding pairs the grid missed or invented compared to the brute-force scan.
+   * When `gpu_grid` is passed, the cell contents read back from the gpu are compared to the cpu grid as well. */
+  inline Uint verify_broadphase(const MVector<ComputeData> &data, float cell_size, Uint table_size, const BroadphaseGrid *gpu_grid = nullptr) {
+    BroadphaseGrid grid;
+    build_grid(&grid, data, cell_size, table_size);
+    Uint errors = 0;
+    if (gpu_grid) {
+      for (Uint h = 0; h <= table_size; ++h) {
+        if (gpu_grid->start[h] != grid.start[h]) {
+          fprintf(stderr, "broadphase: cell %u starts at %u on the gpu, expected %u\n", h, gpu_grid->start[h], grid.start[h]);
+          ++errors;
+        }
+      }
+      /* The order inside a cell depends on atomics, so only membership is compared. */
+      for (Uint i = 0; i < data.size() && !errors; ++i) {
+        Uint h = grid_hash(grid_cell(data[i].pos, cell_size), table_size);
+        bool found = false;
+        for (Uint s = gpu_grid->start[h]; s < gpu_grid->start[h + 1]; ++s) {
+          found |= (gpu_grid->bodies[s] == i);
+        }
+        if (!found) {
+          fprintf(stderr, "broadphase: body %u missing from cell %u on the gpu\n", i, h);
+          ++errors;
+        }
+      }
+    }
+    MVector<Pair<Uint, Uint>> expected;
+    MVector<Pair<Uint, Uint>> found;
+    brute_force_pairs(&expected, data);
+    grid_pairs(&found, data, grid, cell_size);
+    for (const auto &e : expected) {
+      bool match = false;
+      for (const auto &f : found) {
+        match |= ((e.first == f.first && e.second == f.second) || (e.first == f.second && e.second == f.first));
+      }
+      if (!match) {
+        fprintf(stderr, "broadphase: pair (%u, %u) missed by the grid\n", e.first, e.second);
+        ++errors;
+      }
+    }
+    if (found.size() != expected.size()) {
+      fprintf(stderr, "broadphase: grid found %u pairs, brute force found %u\n", found.size(), expected.size());
+      ++errors;
+    }
+    return errors;
+  }
+}
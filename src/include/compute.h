@@ -1,13 +1,23 @@
 #pragma once
 
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <utility>
 #include <GL/glew.h>
 #include <Mlib/Vector.h>
 // #include <glm/glm.hpp>
 #include <Mlib/openGL/shader.h>
 
+#include "profiler.h"
+#include "log.h"
+
 namespace /* Defines */ {
   #define FPS 120
   #define FRAMETIME_S (1.0f / FPS)
+  /* Physics runs at its own fixed rate, independent of `FPS`. */
+  #define SIM_HZ 120
+  #define SIM_DT_S (1.0f / SIM_HZ)
 
   #define __INLINE_NAMESPACE(name) \
     __inline__ namespace name
@@ -19,12 +29,15 @@ namespace /* Defines */ {
 }
 
 __INLINE_NAMESPACE(ComputeStructs) {
+  /* Must match `Particle` in shader.comp, a particle is dead while `pos_life.w` is zero or less. */
   struct Particle {
-    vec3 pos;
-    vec3 vel;
-    vec3 accel;
+    vec4 pos_life;
+    vec4 vel_size;
+    vec4 color;
   };
 
+  static_assert(sizeof(Particle) == 48, "Particle must match its std430 layout");
+
   struct ComputeData {
     vec3 pos;
     vec3 vel;
@@ -34,59 +47,549 @@ __INLINE_NAMESPACE(ComputeStructs) {
   } __align_size(16);
 }
 
+/* Mesh flags shared with shader.comp. */
+#define STATIC_MESH   1
+#define SLEEPING_MESH 2
+
+/* Bodies slower than `SLEEP_VELOCITY` for `SLEEP_STEPS` steps in a row are put to sleep, and skipped by
+ * both operations until something wakes them.  The velocity has to stay above `GRAVITY * SIM_DT_S`, so a
+ * body resting on something still counts as resting.  `flags[1]` of a body holds its step count. */
+#define SLEEP_VELOCITY 0.15f
+#define SLEEP_STEPS    60
+/* A sleeping body wakes when a moving one touches it, or when nothing holds it up any more, the gap under
+ * it may be up to `SUPPORT_MARGIN`.  The wake then spreads through every body touching it, one contact per
+ * pass, for `WAKE_SPREAD_PASSES` passes per step.  An island deeper than that finishes waking over the
+ * next steps. */
+#define SUPPORT_MARGIN     0.01f
+#define WAKE_SPREAD_PASSES 16
+
+#include "body_layout.h"
+
 enum OperationType {
   GRAVITY_OPERATION,
-  COLLISION_OPERATION
+  COLLISION_OPERATION,
+  /* Broad phase passes, these are run internally by `perform(COLLISION_OPERATION)` when the grid is enabled. */
+  GRID_CLEAR_OPERATION,
+  GRID_COUNT_OPERATION,
+  GRID_SCAN_OPERATION,
+  GRID_SCATTER_OPERATION,
+  /* Gravity and collision in a single dispatch, ping-ponging between two body buffers. */
+  FUSED_OPERATION,
+  /* Particle passes, run by `ParticleSystem`. */
+  PARTICLE_EMIT_OPERATION,
+  PARTICLE_UPDATE_OPERATION,
+  /* Builds the indirect draw commands of the bodies, run by `IndirectRenderer`. */
+  CULL_OPERATION,
+  /* Wake passes, run internally by `perform(COLLISION_OPERATION)`, see `wake_islands()`. */
+  WAKE_SEED_OPERATION,
+  WAKE_SPREAD_OPERATION
 };
 
+/* Depth of the readback ring, see `ComputeObject::request_readback()`. */
+#define READBACK_RING 3
+
+typedef struct {
+  /* Copies issued, copies unpacked into `data`, and copies never unpacked, because they were overwritten
+   * or a newer one had finished by the time they were polled. */
+  Ulong requests;
+  Ulong completed;
+  Ulong dropped;
+  /* Frames between issuing a copy and consuming it, of the last one and summed over all of them. */
+  Uint latency;
+  Ulong total_latency;
+  /* Time the cpu spent blocked in `glClientWaitSync()` waiting for the gpu, only `readback()` ever blocks.
+   * Unpacking the body state into `data` is counted apart, in `unpack_ms`, since it costs the same either way. */
+  double stall_ms;
+  double unpack_ms;
+} ReadbackStats;
+
 class ComputeObject {
  private:
+  /* One copy of the body state on its way back to the cpu. */
+  typedef struct {
+    Uint buffer[BODY_MAX_FIELDS];
+    const Uchar *mapped[BODY_MAX_FIELDS];
+    GLsync fence;
+    /* Steps the copy is ahead of the one before it, and the poll it was issued at. */
+    Uint steps;
+    Ulong poll;
+  } ReadbackSlot;
+
   int dt_loc;
   int f_loc;
   int operation_loc;
+  int base_loc;
+  int use_grid_loc;
+  int wake_pass_loc;
+  /* Spatial hash broad phase buffers, see shader.comp. */
+  Uint grid_count_ssbo;
+  Uint grid_start_ssbo;
+  Uint grid_body_ssbo;
+  Uint grid_table_size = 0;
+  /* Wake requests for sleeping bodies, after a count of the bodies woken by each wake pass. */
+  Uint wake_ssbo;
+  /* Workgroup size of `program`, and the max number of workgroups per dispatch. */
+  Uint local_size = 1;
+  Uint max_groups;
+  /* Packed body buffers, see body_layout.h.  `BODY_SET_IN` holds the current state and `BODY_SET_OUT` the
+   * output of FUSED_OPERATION, the two are swapped after every fused step.  In aos mode only the first
+   * buffer of each set is used, in soa mode there is one per field. */
+  Uint body_ssbo[BODY_SET_COUNT][BODY_MAX_FIELDS] = {};
+  /* Persistent mapping of the state buffers, only valid in resident mode. */
+  Uchar *body_mapped[BODY_SET_COUNT][BODY_MAX_FIELDS] = {};
+  /* Layout the program was built with, see `create_comp_shader_program()`. */
+  bool soa = false;
+  /* Staging for packing `data` on its way to and from the gpu. */
+  MVector<BodyState> packed;
+  MVector<BodyStatic> packed_static;
+  /* Set once `upload_static()` has run, a non-resident `perform()` uploads it on first use. */
+  bool static_uploaded = false;
+  /* Ring of readback copies, `readback_pending` of them starting at `readback_tail` are in flight. */
+  ReadbackSlot readback_ring[READBACK_RING] = {};
+  Uint readback_tail = 0;
+  Uint readback_pending = 0;
+  bool readback_ready = false;
+  /* Steps of copies that were overwritten, they are added to the next one consumed. */
+  Uint readback_carry = 0;
+  Ulong readback_polls = 0;
+
+  /* Readback buffers are created on first use, with persistent mappings the cpu reads straight from. */
+  void init_readback_ring(void) {
+    const GLbitfield flags = (GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    for (Uint s = 0; s < READBACK_RING; ++s) {
+      for (Uint k = 0; k < body_buffer_count(BODY_SET_IN, soa); ++k) {
+        Ulong size = (data.size() * body_buffer_stride(BODY_SET_IN, soa, k));
+        glGenBuffers(1, &readback_ring[s].buffer[k]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, readback_ring[s].buffer[k]);
+        glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, (flags | GL_CLIENT_STORAGE_BIT));
+        readback_ring[s].mapped[k] = (const Uchar *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+      }
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    readback_ready = true;
+  }
+
+  /* Allocate the buffers of `set`.  In resident mode the state buffers get immutable storage that stays
+   * mapped for the lifetime of the buffer. */
+  void init_body_buffers(BodySet set) {
+    const GLbitfield flags = (GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    for (Uint k = 0; k < body_buffer_count(set, soa); ++k) {
+      Ulong size = (data.size() * body_buffer_stride(set, soa, k));
+      glGenBuffers(1, &body_ssbo[set][k]);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, body_ssbo[set][k]);
+      if (resident && set != BODY_SET_STATIC) {
+        glBufferStorage(GL_SHADER_STORAGE_BUFFER, size, nullptr, flags);
+        body_mapped[set][k] = (Uchar *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, flags);
+      }
+      else {
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, GL_DYNAMIC_COPY);
+      }
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  void bind_body_buffers(void) {
+    for (Uint set = 0; set < BODY_SET_COUNT; ++set) {
+      for (Uint k = 0; k < body_buffer_count((BodySet)set, soa); ++k) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, body_buffer_binding((BodySet)set, soa, k), body_ssbo[set][k]);
+      }
+    }
+  }
+
+  /* Write `count` packed structs from `src` into `set`, starting at body `first`.  Goes through the
+   * persistent mapping when there is one, otherwise each buffer range is mapped for the copy. */
+  void write_bodies(BodySet set, const void *src, Uint first, Uint count) {
+    Uchar *dst[BODY_MAX_FIELDS];
+    Uint buffers = body_buffer_count(set, soa);
+    for (Uint k = 0; k < buffers; ++k) {
+      Uint stride = body_buffer_stride(set, soa, k);
+      if (body_mapped[set][k]) {
+        dst[k] = (body_mapped[set][k] + (first * stride));
+        continue;
+      }
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, body_ssbo[set][k]);
+      dst[k] = (Uchar *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, (first * stride), (count * stride), (GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT));
+    }
+    scatter_bodies(set, soa, src, count, dst);
+    for (Uint k = 0; k < buffers; ++k) {
+      if (!body_mapped[set][k]) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, body_ssbo[set][k]);
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+      }
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  /* Read every body of `set` into `dst`, the caller makes sure the gpu is done writing. */
+  void read_bodies(BodySet set, void *dst) {
+    const Uchar *src[BODY_MAX_FIELDS];
+    Uint buffers = body_buffer_count(set, soa);
+    for (Uint k = 0; k < buffers; ++k) {
+      if (body_mapped[set][k]) {
+        src[k] = body_mapped[set][k];
+        continue;
+      }
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, body_ssbo[set][k]);
+      src[k] = (const Uchar *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, (data.size() * body_buffer_stride(set, soa, k)), GL_MAP_READ_BIT);
+    }
+    gather_bodies(set, soa, src, data.size(), dst);
+    for (Uint k = 0; k < buffers; ++k) {
+      if (!body_mapped[set][k]) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, body_ssbo[set][k]);
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+      }
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  /* Pack bodies [first, first + count) of `data`, and write their state to the gpu. */
+  void write_state(Uint first, Uint count) {
+    for (Uint i = first; i < (first + count); ++i) {
+      packed[i] = pack_state(data[i]);
+    }
+    write_bodies(BODY_SET_IN, (packed.data() + first), first, count);
+  }
+
+  /* Read the state of every body back from the gpu, and unpack it into `data`.  Size and acceleration
+   * never change on the gpu, so those are left as they are. */
+  void read_state(void) {
+    read_bodies(BODY_SET_IN, packed.data());
+    for (Uint i = 0; i < data.size(); ++i) {
+      unpack_state(packed[i], &data[i]);
+    }
+  }
+
+  /* Run `operation` with one invocation per item, the shader bounds checks the partly used last workgroup.
+   * More workgroups than the driver allows in one dispatch are split over several, each starting at
+   * `dispatch_base` in shader.comp. */
+  void dispatch(Uint operation, Uint items) {
+    Uint groups = ((items + local_size - 1) / local_size);
+    glUniform1ui(operation_loc, operation);
+    for (Uint first = 0; first < groups; first += max_groups) {
+      glUniform1ui(base_loc, (first * local_size));
+      glDispatchCompute(glm::min((groups - first), max_groups), 1, 1);
+    }
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+
+  /* Sort all bodies into the hash grid, using a count, prefix-sum and scatter pass. */
+  void build_grid(void) {
+    dispatch(GRID_CLEAR_OPERATION,   grid_table_size);
+    dispatch(GRID_COUNT_OPERATION,   data.size());
+    /* A single workgroup, the scan synchronizes through shared memory. */
+    dispatch(GRID_SCAN_OPERATION,    local_size);
+    dispatch(GRID_SCATTER_OPERATION, data.size());
+  }
+
+  /* Wake the sleeping bodies that were touched or lost their support, then spread the wakes through their
+   * contact islands.  Once an island is awake the remaining passes return right away. */
+  void wake_islands(void) {
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wake_ssbo);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, ((WAKE_SPREAD_PASSES + 1) * sizeof(Uint)), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    for (Uint pass = 0; pass <= WAKE_SPREAD_PASSES; ++pass) {
+      glUniform1ui(wake_pass_loc, pass);
+      dispatch((pass ? WAKE_SPREAD_OPERATION : WAKE_SEED_OPERATION), data.size());
+    }
+  }
 
  public:
   Uint operation;
-  Uint ssbo;
-  Uint program;
+  Uint program = 0;
+  /* When set, body state lives on the gpu between calls to `perform()`, and is only
+   * transferred when `upload()` or `readback()` is called explicitly. */
+  bool resident = false;
   MVector<ComputeData> data;
 
   ~ComputeObject(void) {
-    glDeleteBuffers(1, &ssbo);
+    if (grid_table_size) {
+      glDeleteBuffers(1, &grid_count_ssbo);
+      glDeleteBuffers(1, &grid_start_ssbo);
+      glDeleteBuffers(1, &grid_body_ssbo);
+    }
+    for (Uint set = 0; set < BODY_SET_COUNT; ++set) {
+      glDeleteBuffers(BODY_MAX_FIELDS, body_ssbo[set]);
+    }
+    glDeleteBuffers(1, &wake_ssbo);
+    if (readback_ready) {
+      for (Uint s = 0; s < READBACK_RING; ++s) {
+        glDeleteBuffers(BODY_MAX_FIELDS, readback_ring[s].buffer);
+        if (readback_ring[s].fence) {
+          glDeleteSync(readback_ring[s].fence);
+        }
+      }
+    }
     glDeleteProgram(program);
   }
 
-  void init(Uint program, Uint num) {
+  /* `program` is queried here, so create every program first and call `finish_shader_programs()` before this. */
+  void init(Uint program, Uint num, bool resident = false) {
     for (Uint i = 0; i < num; ++i) {
       data.push_back({});
     }
-    this->program = program;
-    glGenBuffers(1, &ssbo);
+    packed.resize(num);
+    packed_static.resize(num);
+    this->program  = program;
+    this->resident = (resident && num > 0);
+    /* A program built with the soa layout has one state block per field instead of `BodyStateIn`.  Looks for
+     * the block of the first field, so a program that failed to link is taken as aos rather than soa. */
+    std::string soa_block = (std::string(body_sets[BODY_SET_IN].block) + "_" + body_sets[BODY_SET_IN].fields[0].name);
+    soa = (glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK, soa_block.c_str()) != GL_INVALID_INDEX);
+    /* The workgroup size was picked, and checked against the driver limits, when the program was created. */
+    int group_size[3];
+    int group_count;
+    glGetProgramiv(program, GL_COMPUTE_WORK_GROUP_SIZE, group_size);
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &group_count);
+    local_size = (Uint)group_size[0];
+    max_groups = (Uint)group_count;
     glUseProgram(program);
     // Set Uniforms.
     dt_loc        = glGetUniformLocation(program, "delta_t");
     f_loc         = glGetUniformLocation(program, "c_force");
     operation_loc = glGetUniformLocation(program, "operation");
-    glUniform1f(dt_loc, FRAMETIME_S);
+    base_loc      = glGetUniformLocation(program, "dispatch_base");
+    use_grid_loc  = glGetUniformLocation(program, "use_grid");
+    wake_pass_loc = glGetUniformLocation(program, "wake_pass");
+    glUniform1f(dt_loc, SIM_DT_S);
     glUniform3f(f_loc, 0.0f, -9.806f, 0.0f);
+    glUniform1i(use_grid_loc, GL_FALSE);
+    glUniform1f(glGetUniformLocation(program, "sleep_velocity"), SLEEP_VELOCITY);
+    glUniform1i(glGetUniformLocation(program, "sleep_steps"), SLEEP_STEPS);
+    glUniform1f(glGetUniformLocation(program, "support_margin"), SUPPORT_MARGIN);
+    /* No wake requests to begin with. */
+    MVector<Uint> zero;
+    zero.resize(WAKE_SPREAD_PASSES + 1 + num);
+    for (Uint i = 0; i < zero.size(); ++i) {
+      zero[i] = 0;
+    }
+    glGenBuffers(1, &wake_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wake_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (zero.size() * sizeof(Uint)), zero.data(), GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, wake_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    for (Uint set = 0; set < BODY_SET_COUNT; ++set) {
+      init_body_buffers((BodySet)set);
+    }
+    bind_body_buffers();
   }
 
-  void perform(Uint operation) {
+  /* Enable the spatial hash broad phase for COLLISION_OPERATION.  `cell_size` must be at least the
+   * largest extent of any body, see `Broadphase::grid_cell_size()`. */
+  void init_grid(Uint table_size, float cell_size) {
+    grid_table_size = table_size;
+    glGenBuffers(1, &grid_count_ssbo);
+    glGenBuffers(1, &grid_start_ssbo);
+    glGenBuffers(1, &grid_body_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_count_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (table_size * sizeof(Uint)), nullptr, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, grid_count_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_start_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, ((table_size + 1) * sizeof(Uint)), nullptr, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, grid_start_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_body_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (data.size() * sizeof(Uint)), nullptr, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, grid_body_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
     glUseProgram(program);
-    glUniform1ui(operation_loc, operation);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
-    // Input data into shader buffer.
-    glBufferData(GL_SHADER_STORAGE_BUFFER, (data.size() * sizeof(ComputeData)), data.data(), GL_DYNAMIC_COPY);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ssbo);
-    // Dispatch compute shader.
-    glDispatchCompute(data.size(), 1, 1);
-    // Ensure completion before accessing buffer data.
-    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-    ComputeData *ptr = (ComputeData *)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+    glUniform1i(use_grid_loc, GL_TRUE);
+    glUniform1f(glGetUniformLocation(program, "grid_cell_size"), cell_size);
+    glUniform1ui(glGetUniformLocation(program, "grid_table_size"), table_size);
+  }
+
+  /* Read the grid built by the last COLLISION_OPERATION or FUSED_OPERATION back, so it can be checked with
+   * `Broadphase::verify_broadphase()`, see `--verify-broadphase` in bench/3d_sim_bench.cpp. */
+  void read_grid(MVector<Uint> *start, MVector<Uint> *bodies) {
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    start->resize(grid_table_size + 1);
+    bodies->resize(data.size());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_start_ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, ((grid_table_size + 1) * sizeof(Uint)), start->data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_body_ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (data.size() * sizeof(Uint)), bodies->data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  /* Write `count` bodies starting at `first` from `data` into the resident buffer. */
+  void upload(Uint first, Uint count) {
+    if (!resident) {
+      return;
+    }
+    write_state(first, count);
+  }
+
+  /* Write the size and acceleration of every body, these are read-only on the gpu and only have to be
+   * uploaded again when they change. */
+  void upload_static(void) {
+    float max_accel = 0.0f;
     for (Uint i = 0; i < data.size(); ++i) {
-      data[i] = ptr[i];
+      packed_static[i] = pack_static(data[i]);
+      max_accel = fmaxf(max_accel, length(data[i].accel));
     }
-    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    write_bodies(BODY_SET_STATIC, packed_static.data(), 0, data.size());
+    /* Bounds how far the fused step can move a body, see `step_reach()` in shader.comp. */
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "max_accel"), max_accel);
+    static_uploaded = true;
+  }
+
+  /* Write all bodies in `data` to the gpu. */
+  void upload(void) {
+    upload_static();
+    upload(0, data.size());
+  }
+
+  /* Layout the program was built with, render programs reading the body buffers have to use the same. */
+  bool soa_layout(void) const {
+    return soa;
+  }
+
+  /* Bind the body buffers to their bindings again, in case something else was bound there. */
+  void bind_bodies(void) {
+    bind_body_buffers();
+  }
+
+  ReadbackStats readback_stats = {};
+
+  /* Wait for all dispatched work to finish, then copy the resident buffer back into `data`.  This stalls
+   * until the gpu drains, `request_readback()` and `poll_readback()` get the same state without waiting. */
+  void readback(void) {
+    PROFILE_SCOPE("compute readback");
+    if (!resident) {
+      return;
+    }
+    glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    auto start = std::chrono::high_resolution_clock::now();
+    glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    auto waited = std::chrono::high_resolution_clock::now();
+    glDeleteSync(fence);
+    read_state();
+    readback_stats.stall_ms  += std::chrono::duration<double, std::milli>(waited - start).count();
+    readback_stats.unpack_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - waited).count();
+  }
+
+  /* Queue a copy of the current body state into the next buffer of the readback ring, guarded by a fence,
+   * without waiting for anything.  `steps` is how many steps were run since the last request.  When every
+   * buffer is still in flight the oldest copy is overwritten.  Only in resident mode. */
+  void request_readback(Uint steps) {
+    if (!resident) {
+      return;
+    }
+    if (!readback_ready) {
+      init_readback_ring();
+    }
+    if (readback_pending == READBACK_RING) {
+      ReadbackSlot &old = readback_ring[readback_tail];
+      glDeleteSync(old.fence);
+      old.fence = nullptr;
+      readback_carry += old.steps;
+      readback_tail = ((readback_tail + 1) % READBACK_RING);
+      --readback_pending;
+      ++readback_stats.dropped;
+    }
+    ReadbackSlot &slot = readback_ring[(readback_tail + readback_pending) % READBACK_RING];
+    /* The copy reads what the shader wrote, and the cpu reads the copy through the mapping. */
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    for (Uint k = 0; k < body_buffer_count(BODY_SET_IN, soa); ++k) {
+      glBindBuffer(GL_COPY_READ_BUFFER, body_ssbo[BODY_SET_IN][k]);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, slot.buffer[k]);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (data.size() * body_buffer_stride(BODY_SET_IN, soa, k)));
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.steps = steps;
+    slot.poll  = readback_polls;
+    ++readback_pending;
+    ++readback_stats.requests;
+    /* Make sure the fence gets to the gpu, so polling it later can see it signaled. */
+    glFlush();
+  }
+
+  /* Take the newest copy of the readback ring the gpu has finished, if any, into `data`, without waiting.
+   * Call once per frame.  Returns how many steps `data` moved ahead, 0 when nothing new finished.  The
+   * state `data` held before is moved into `previous` when given. */
+  Uint poll_readback(MVector<ComputeData> *previous = nullptr) {
+    ++readback_polls;
+    if (!readback_pending) {
+      return 0;
+    }
+    /* Copies finish in the order they were issued, so stop at the first one that is not done.  Polled with a
+     * zero timeout, so this never stalls. */
+    Uint done = 0;
+    for (; done < readback_pending; ++done) {
+      GLenum status = glClientWaitSync(readback_ring[(readback_tail + done) % READBACK_RING].fence, 0, 0);
+      if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+        break;
+      }
+    }
+    if (!done) {
+      return 0;
+    }
+    Uint steps = readback_carry;
+    readback_carry = 0;
+    for (Uint i = 0; i < done; ++i) {
+      ReadbackSlot &slot = readback_ring[readback_tail];
+      glDeleteSync(slot.fence);
+      slot.fence = nullptr;
+      steps += slot.steps;
+      if (i == (done - 1)) {
+        if (previous) {
+          *previous = data;
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        gather_bodies(BODY_SET_IN, soa, slot.mapped, data.size(), packed.data());
+        for (Uint b = 0; b < data.size(); ++b) {
+          unpack_state(packed[b], &data[b]);
+        }
+        readback_stats.unpack_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        readback_stats.latency = (Uint)(readback_polls - slot.poll);
+        readback_stats.total_latency += readback_stats.latency;
+        readback_stats.completed += 1;
+      }
+      readback_tail = ((readback_tail + 1) % READBACK_RING);
+      --readback_pending;
+    }
+    /* Consumed on the way to a newer copy, never unpacked. */
+    readback_stats.dropped += (done - 1);
+    return steps;
+  }
+
+  void report_readback(FILE *out = stdout) const {
+    double completed = (readback_stats.completed ? (double)readback_stats.completed : 1.0);
+    fprintf(out, "readback: %lu requested, %lu consumed, %lu dropped, %.2f frames behind on average, %.3f ms stalled on the gpu, %.3f ms unpacking\n",
+      readback_stats.requests, readback_stats.completed, readback_stats.dropped, (readback_stats.total_latency / completed), readback_stats.stall_ms, readback_stats.unpack_ms);
+  }
+
+  void perform(Uint operation) {
+    PROFILE_GPU_SCOPE("compute perform");
+    glUseProgram(program);
+    if (!resident) {
+      // Input data into shader buffer.
+      if (!static_uploaded) {
+        upload_static();
+      }
+      write_state(0, data.size());
+    }
+    if (operation == COLLISION_OPERATION || operation == FUSED_OPERATION) {
+      if (grid_table_size) {
+        build_grid();
+      }
+      wake_islands();
+    }
+    // Dispatch compute shader, and ensure completion before accessing buffer data.
+    dispatch(operation, data.size());
+    if (operation == FUSED_OPERATION) {
+      /* The output of this step is the input of the next. */
+      std::swap(body_ssbo[BODY_SET_IN], body_ssbo[BODY_SET_OUT]);
+      std::swap(body_mapped[BODY_SET_IN], body_mapped[BODY_SET_OUT]);
+      bind_body_buffers();
+    }
+    /* In resident mode the buffer stays on the gpu until `readback()` is called. */
+    if (resident) {
+      return;
+    }
+    read_state();
   }
 };
\ No newline at end of file
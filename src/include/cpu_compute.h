@@ -0,0 +1,452 @@
+#pragma once
+
+/* clang-format off */
+
+#include <immintrin.h>
+#include <math.h>
+
+#include "compute.h"
+#include "thread_pool.h"
+
+/* Cpu physics backend, mirroring shader.comp for machines without a gpu.  Bodies are stored as
+ * structure-of-arrays, so the integrator and the aabb tests can run `CPU_LANES` bodies at a time. */
+
+namespace /* Define. */ {
+  #if defined(__AVX__)
+    #define CPU_LANES 8
+    typedef __m256 simd_float;
+    #define simd_load(p)           _mm256_loadu_ps(p)
+    #define simd_store(p, v)       _mm256_storeu_ps(p, v)
+    #define simd_set1(f)           _mm256_set1_ps(f)
+    #define simd_add(a, b)         _mm256_add_ps(a, b)
+    #define simd_sub(a, b)         _mm256_sub_ps(a, b)
+    #define simd_mul(a, b)         _mm256_mul_ps(a, b)
+    #define simd_div(a, b)         _mm256_div_ps(a, b)
+    #define simd_and(a, b)         _mm256_and_ps(a, b)
+    #define simd_or(a, b)          _mm256_or_ps(a, b)
+    #define simd_cmplt(a, b)       _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+    #define simd_cmpge(a, b)       _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+    #define simd_cmple(a, b)       _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+    #define simd_blend(a, b, mask) _mm256_blendv_ps(a, b, mask)
+    #define simd_movemask(v)       _mm256_movemask_ps(v)
+  #elif defined(__SSE2__)
+    #define CPU_LANES 4
+    typedef __m128 simd_float;
+    #define simd_load(p)           _mm_loadu_ps(p)
+    #define simd_store(p, v)       _mm_storeu_ps(p, v)
+    #define simd_set1(f)           _mm_set1_ps(f)
+    #define simd_add(a, b)         _mm_add_ps(a, b)
+    #define simd_sub(a, b)         _mm_sub_ps(a, b)
+    #define simd_mul(a, b)         _mm_mul_ps(a, b)
+    #define simd_div(a, b)         _mm_div_ps(a, b)
+    #define simd_and(a, b)         _mm_and_ps(a, b)
+    #define simd_or(a, b)          _mm_or_ps(a, b)
+    #define simd_cmplt(a, b)       _mm_cmplt_ps(a, b)
+    #define simd_cmpge(a, b)       _mm_cmpge_ps(a, b)
+    #define simd_cmple(a, b)       _mm_cmple_ps(a, b)
+    #define simd_blend(a, b, mask) _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b))
+    #define simd_movemask(v)       _mm_movemask_ps(v)
+  #else
+    #define CPU_LANES 1
+  #endif
+}
+
+class CpuComputeObject {
+ private:
+  float dt;
+  vec3 force;
+  /* Structure-of-arrays body state. */
+  MVector<float> px, py, pz;
+  MVector<float> vx, vy, vz;
+  MVector<float> ax, ay, az;
+  MVector<float> sx, sy, sz;
+  MVector<int> flags0, flags1;
+  /* Snapshot of the positions and flags at the start of a collision pass, so every body resolves against the same state. */
+  MVector<float> snap_x, snap_y, snap_z;
+  MVector<int> snap_flags;
+  /* Wake requests for sleeping bodies, see `WakeBuffer` in shader.comp.  Written by other threads, so only
+   * ever accessed atomically. */
+  MVector<Uint> wake;
+  /* Bodies woken by the current wake pass. */
+  Uint woken;
+
+  typedef struct {
+    vec3 pos;
+    vec3 size;
+  } Box;
+
+  bool is_static(Uint i) const {
+    return (flags0[i] & (1 << STATIC_MESH));
+  }
+
+  bool is_sleeping(Uint i) const {
+    return (flags0[i] & (1 << SLEEPING_MESH));
+  }
+
+  /* Scalar integrator for a single body, must match `rk4_step()` and GRAVITY_OPERATION in shader.comp. */
+  void integrate(Uint i) {
+    if (is_static(i)) {
+      vx[i] = vy[i] = vz[i] = 0.0f;
+      ax[i] = ay[i] = az[i] = 0.0f;
+      return;
+    }
+    if (is_sleeping(i)) {
+      return;
+    }
+    float *p[3] = {&px[i], &py[i], &pz[i]};
+    float *v[3] = {&vx[i], &vy[i], &vz[i]};
+    const float a[3] = {ax[i], ay[i], az[i]};
+    for (Uint c = 0; c < 3; ++c) {
+      float f  = ((force[c] + a[c]) * dt);
+      float k1 = (*v[c] * dt);
+      float k2 = ((*v[c] + 0.5f * f) * dt);
+      float k3 = k2;
+      float k4 = ((*v[c] + f) * dt);
+      *p[c] += ((k1 + 2.0f * k2 + 2.0f * k3 + k4) / 6.0f);
+      *v[c] += ((f + 2.0f * f + 2.0f * f + f) / 6.0f);
+    }
+    if ((py[i] - (sy[i] / 2)) < 0.0f) {
+      py[i] = 0.0f;
+      vy[i] = 0.0f;
+    }
+  }
+
+  #if CPU_LANES > 1
+  /* Integrate `CPU_LANES` bodies starting at `i`. */
+  void integrate_lanes(Uint i) {
+    const simd_float zero = simd_set1(0.0f);
+    const simd_float half = simd_set1(0.5f);
+    const simd_float two  = simd_set1(2.0f);
+    const simd_float six  = simd_set1(6.0f);
+    const simd_float vdt  = simd_set1(dt);
+    float is_static_lane[CPU_LANES];
+    float is_frozen_lane[CPU_LANES];
+    for (Uint l = 0; l < CPU_LANES; ++l) {
+      is_static_lane[l] = (is_static(i + l) ? 1.0f : 0.0f);
+      is_frozen_lane[l] = ((is_static(i + l) || is_sleeping(i + l)) ? 1.0f : 0.0f);
+    }
+    /* Static and sleeping bodies are both frozen in place, only static ones lose their acceleration. */
+    const simd_float static_mask  = simd_cmplt(simd_set1(0.5f), simd_load(is_static_lane));
+    const simd_float frozen_mask  = simd_cmplt(simd_set1(0.5f), simd_load(is_frozen_lane));
+    const simd_float dynamic_mask = simd_cmplt(simd_load(is_frozen_lane), simd_set1(0.5f));
+    float *p[3] = {&px[i], &py[i], &pz[i]};
+    float *v[3] = {&vx[i], &vy[i], &vz[i]};
+    float *a[3] = {&ax[i], &ay[i], &az[i]};
+    simd_float pos[3];
+    simd_float vel[3];
+    for (Uint c = 0; c < 3; ++c) {
+      pos[c] = simd_load(p[c]);
+      vel[c] = simd_load(v[c]);
+      simd_float accel = simd_load(a[c]);
+      simd_float f  = simd_mul(simd_add(simd_set1(force[c]), accel), vdt);
+      simd_float k1 = simd_mul(vel[c], vdt);
+      simd_float k2 = simd_mul(simd_add(vel[c], simd_mul(half, f)), vdt);
+      simd_float k3 = k2;
+      simd_float k4 = simd_mul(simd_add(vel[c], f), vdt);
+      simd_float new_pos = simd_add(pos[c], simd_div(simd_add(simd_add(simd_add(k1, simd_mul(two, k2)), simd_mul(two, k3)), k4), six));
+      simd_float new_vel = simd_add(vel[c], simd_div(simd_add(simd_add(simd_add(f, simd_mul(two, f)), simd_mul(two, f)), f), six));
+      /* Frozen bodies keep their position, and have no velocity. */
+      pos[c] = simd_blend(new_pos, pos[c], frozen_mask);
+      vel[c] = simd_blend(new_vel, zero, frozen_mask);
+      simd_store(a[c], simd_blend(accel, zero, static_mask));
+    }
+    /* Ground clamp. */
+    simd_float ground = simd_cmplt(simd_sub(pos[1], simd_div(simd_load(&sy[i]), two)), zero);
+    ground = simd_and(ground, dynamic_mask);
+    pos[1] = simd_blend(pos[1], zero, ground);
+    vel[1] = simd_blend(vel[1], zero, ground);
+    for (Uint c = 0; c < 3; ++c) {
+      simd_store(p[c], pos[c]);
+      simd_store(v[c], vel[c]);
+    }
+  }
+  #endif
+
+  /* Must match `contact()` in shader.comp.  Returns true when `idx` was moved. */
+  bool resolve(Uint idx, Uint i, bool disturbing) {
+    Box o  = {{px[idx], py[idx], pz[idx]}, {sx[idx], sy[idx], sz[idx]}};
+    Box so = {{snap_x[i], snap_y[i], snap_z[i]}, {sx[i], sy[i], sz[i]}};
+    if (!MESH_COLLIDING(&o, &so)) {
+      return false;
+    }
+    if (disturbing && (snap_flags[i] & (1 << SLEEPING_MESH))) {
+      __atomic_store_n(&wake[i], 1u, __ATOMIC_RELAXED);
+    }
+    if (MESH_OVERLAP_LEAST_B(&o, &so)) {
+      py[idx] = (MESH_B(&so) + (o.size.y / 2));
+      vy[idx] = 0.0f;
+      return true;
+    }
+    else if (MESH_OVERLAP_LEAST_T(&o, &so)) {
+      py[idx] = (MESH_T(&so) - (o.size.y / 2));
+      vy[idx] = 0.0f;
+      return true;
+    }
+    return false;
+  }
+
+  /* Must match `update_sleep()` in shader.comp. */
+  void update_sleep(Uint idx) {
+    if (sqrtf(vx[idx] * vx[idx] + vy[idx] * vy[idx] + vz[idx] * vz[idx]) >= SLEEP_VELOCITY) {
+      flags1[idx] = 0;
+      return;
+    }
+    if (++flags1[idx] >= SLEEP_STEPS) {
+      flags0[idx] |= (1 << SLEEPING_MESH);
+      vx[idx] = vy[idx] = vz[idx] = 0.0f;
+      /* `wake[idx]` is left alone, the next `wake_islands()` acts on it. */
+    }
+  }
+
+  /* Collision step of body `idx`, must match `step_collision()` in shader.comp.  The aabb overlap against
+   * the other bodies is tested `CPU_LANES` bodies at a time. */
+  void collide(Uint idx) {
+    if (is_static(idx)) {
+      vx[idx] = vy[idx] = vz[idx] = 0.0f;
+      ax[idx] = ay[idx] = az[idx] = 0.0f;
+      return;
+    }
+    /* Sleeping bodies skip collision entirely, until the wake passes wake them. */
+    if (is_sleeping(idx)) {
+      return;
+    }
+    const bool disturbing = (flags1[idx] == 0);
+    const Uint n = data.size();
+    Uint i = 0;
+    #if CPU_LANES > 1
+    for (; (i + CPU_LANES) <= n; i += CPU_LANES) {
+      const simd_float half = simd_set1(0.5f);
+      const float *o_p[3] = {&px[idx], &py[idx], &pz[idx]};
+      const float *o_s[3] = {&sx[idx], &sy[idx], &sz[idx]};
+      const float *s_p[3] = {&snap_x[i], &snap_y[i], &snap_z[i]};
+      const float *s_s[3] = {&sx[i], &sy[i], &sz[i]};
+      simd_float hit = simd_cmple(simd_set1(0.0f), simd_set1(0.0f));
+      for (Uint c = 0; c < 3; ++c) {
+        simd_float o_min  = simd_set1(*o_p[c] - (*o_s[c] / 2));
+        simd_float o_max  = simd_set1(*o_p[c] + (*o_s[c] / 2));
+        simd_float s_half = simd_mul(simd_load(s_s[c]), half);
+        simd_float so_min = simd_sub(simd_load(s_p[c]), s_half);
+        simd_float so_max = simd_add(simd_load(s_p[c]), s_half);
+        hit = simd_and(hit, simd_and(simd_cmpge(o_max, so_min), simd_cmple(o_min, so_max)));
+      }
+      int mask = simd_movemask(hit);
+      if (!mask) {
+        continue;
+      }
+      /* Resolve in order, once `idx` has moved the remaining lanes have to be re-tested against its new position. */
+      bool moved = false;
+      for (Uint l = 0; l < CPU_LANES; ++l) {
+        if ((i + l) != idx && (moved || (mask & (1 << l)))) {
+          moved |= resolve(idx, (i + l), disturbing);
+        }
+      }
+    }
+    #endif
+    for (; i < n; ++i) {
+      if (i != idx) {
+        resolve(idx, i, disturbing);
+      }
+    }
+    update_sleep(idx);
+  }
+
+  /* Must match `wake_test()` in shader.comp, `seed` selects WAKE_SEED_OPERATION over WAKE_SPREAD_OPERATION. */
+  bool wake_test(Uint idx, Uint i, bool seed) {
+    Box o  = {{px[idx], py[idx], pz[idx]}, {sx[idx], sy[idx], sz[idx]}};
+    Box so = {{px[i], py[i], pz[i]}, {sx[i], sy[i], sz[i]}};
+    if (seed) {
+      return (MESH_R(&o) >= MESH_L(&so) && MESH_L(&o) <= MESH_R(&so) &&
+              MESH_BK(&o) >= MESH_F(&so) && MESH_F(&o) <= MESH_BK(&so) &&
+              MESH_T(&so) < MESH_T(&o) && MESH_B(&so) >= (MESH_T(&o) - SUPPORT_MARGIN));
+    }
+    if (!__atomic_load_n(&wake[i], __ATOMIC_RELAXED)) {
+      return false;
+    }
+    o.size += vec3(2.0f * SUPPORT_MARGIN);
+    return MESH_COLLIDING(&o, &so);
+  }
+
+  /* Wake pass of body `idx`, must match `step_wake()` in shader.comp. */
+  void step_wake(Uint idx, bool seed) {
+    if (!is_sleeping(idx)) {
+      if (seed) {
+        __atomic_store_n(&wake[idx], 0u, __ATOMIC_RELAXED);
+      }
+      return;
+    }
+    const Uint n = data.size();
+    bool found = false;
+    for (Uint i = 0; i < n && !found; ++i) {
+      found = (i != idx && wake_test(idx, i, seed));
+    }
+    bool wake_up;
+    if (seed) {
+      /* The floor clamp in `integrate()` leaves a body on the floor sunk into it. */
+      bool supported = (((py[idx] - (sy[idx] / 2)) <= SUPPORT_MARGIN) || found);
+      wake_up = (__atomic_load_n(&wake[idx], __ATOMIC_RELAXED) || !supported);
+    }
+    else {
+      wake_up = found;
+    }
+    if (!wake_up) {
+      return;
+    }
+    flags0[idx] &= ~(1 << SLEEPING_MESH);
+    flags1[idx] = 0;
+    __atomic_store_n(&wake[idx], 1u, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&woken, 1u, __ATOMIC_RELAXED);
+  }
+
+  void wake_range(Uint begin, Uint end, bool seed) {
+    for (Uint idx = begin; idx < end; ++idx) {
+      step_wake(idx, seed);
+    }
+  }
+
+  /* Must match `ComputeObject::wake_islands()`, a pass after one that woke nothing is skipped. */
+  void wake_islands(void) {
+    const Uint n = data.size();
+    for (Uint pass = 0; pass <= WAKE_SPREAD_PASSES; ++pass) {
+      if (pass && !woken) {
+        break;
+      }
+      const bool seed = (pass == 0);
+      woken = 0;
+      if (pool) {
+        pool->parallel_for(n, pool->chunk_size(n), [this, seed](Uint begin, Uint end) { wake_range(begin, end, seed); });
+      }
+      else {
+        wake_range(0, n, seed);
+      }
+    }
+  }
+
+  /* Integrate bodies [begin, end), `begin` must be a multiple of `CPU_LANES`. */
+  void integrate_range(Uint begin, Uint end) {
+    Uint i = begin;
+    #if CPU_LANES > 1
+    for (; (i + CPU_LANES) <= end; i += CPU_LANES) {
+      integrate_lanes(i);
+    }
+    #endif
+    for (; i < end; ++i) {
+      integrate(i);
+    }
+  }
+
+  void collide_range(Uint begin, Uint end) {
+    for (Uint idx = begin; idx < end; ++idx) {
+      collide(idx);
+    }
+  }
+
+  void step_gravity(void) {
+    const Uint n = data.size();
+    if (pool) {
+      pool->parallel_for(n, pool->chunk_size(n, CPU_LANES), [this](Uint begin, Uint end) { integrate_range(begin, end); });
+    }
+    else {
+      integrate_range(0, n);
+    }
+  }
+
+  void step_collision(void) {
+    const Uint n = data.size();
+    memcpy(snap_x.data(), px.data(), (n * sizeof(float)));
+    memcpy(snap_y.data(), py.data(), (n * sizeof(float)));
+    memcpy(snap_z.data(), pz.data(), (n * sizeof(float)));
+    memcpy(snap_flags.data(), flags0.data(), (n * sizeof(int)));
+    if (pool) {
+      pool->parallel_for(n, pool->chunk_size(n), [this](Uint begin, Uint end) { collide_range(begin, end); });
+    }
+    else {
+      collide_range(0, n);
+    }
+  }
+
+ public:
+  /* When set, both operations are split over the threads of the pool.  Collision stays race free because
+   * every body only ever writes its own state, resolving against the snapshot of all other bodies. */
+  ThreadPool *pool = nullptr;
+  /* Same meaning as `ComputeObject::resident`, when unset `perform()` loads and stores `data` on every call. */
+  bool resident = false;
+  MVector<ComputeData> data;
+
+  void init(Uint num, bool resident = false) {
+    for (Uint i = 0; i < num; ++i) {
+      data.push_back({});
+    }
+    this->resident = resident;
+    dt    = SIM_DT_S;
+    force = vec3(0.0f, -9.806f, 0.0f);
+    MVector<float> *arrays[] = {&px, &py, &pz, &vx, &vy, &vz, &ax, &ay, &az, &sx, &sy, &sz, &snap_x, &snap_y, &snap_z};
+    for (auto *array : arrays) {
+      array->resize(num);
+    }
+    flags0.resize(num);
+    flags1.resize(num);
+    snap_flags.resize(num);
+    wake.resize(num);
+    for (Uint i = 0; i < num; ++i) {
+      wake[i] = 0;
+    }
+    woken = 0;
+  }
+
+  /* Scatter `data` into the structure-of-arrays state. */
+  void upload(void) {
+    for (Uint i = 0; i < data.size(); ++i) {
+      const ComputeData &cd = data[i];
+      px[i] = cd.pos.x;   py[i] = cd.pos.y;   pz[i] = cd.pos.z;
+      vx[i] = cd.vel.x;   vy[i] = cd.vel.y;   vz[i] = cd.vel.z;
+      ax[i] = cd.accel.x; ay[i] = cd.accel.y; az[i] = cd.accel.z;
+      sx[i] = cd.size.x;  sy[i] = cd.size.y;  sz[i] = cd.size.z;
+      flags0[i] = cd.flags[0];
+      flags1[i] = cd.flags[1];
+    }
+  }
+
+  /* Gather the structure-of-arrays state back into `data`. */
+  void readback(void) {
+    for (Uint i = 0; i < data.size(); ++i) {
+      ComputeData &cd = data[i];
+      cd.pos   = vec3(px[i], py[i], pz[i]);
+      cd.vel   = vec3(vx[i], vy[i], vz[i]);
+      cd.accel = vec3(ax[i], ay[i], az[i]);
+      cd.size  = vec3(sx[i], sy[i], sz[i]);
+      cd.flags[0] = flags0[i];
+      cd.flags[1] = flags1[i];
+    }
+  }
+
+  void perform(Uint operation) {
+    if (!resident) {
+      upload();
+    }
+    if (operation == COLLISION_OPERATION || operation == FUSED_OPERATION) {
+      wake_islands();
+    }
+    if (operation == GRAVITY_OPERATION || operation == FUSED_OPERATION) {
+      step_gravity();
+    }
+    if (operation == COLLISION_OPERATION || operation == FUSED_OPERATION) {
+      step_collision();
+    }
+    if (!resident) {
+      readback();
+    }
+  }
+};
+
+/* Largest absolute difference in position or velocity between two sets of bodies, used to compare the cpu
+ * backend against the glsl path. */
+inline float max_compute_error(const MVector<ComputeData> &a, const MVector<ComputeData> &b) {
+  float err = 0.0f;
+  for (Uint i = 0; i < a.size() && i < b.size(); ++i) {
+    for (Uint c = 0; c < 3; ++c) {
+      err = fmaxf(err, fabsf(a[i].pos[c] - b[i].pos[c]));
+      err = fmaxf(err, fabsf(a[i].vel[c] - b[i].vel[c]));
+    }
+  }
+  return err;
+}
@@ -107,6 +107,12 @@ namespace /* Define. */ {
      MESH_OVERLAP_BK(o, so) < MESH_OVERLAP_B(o, so))
 }
 
+#include "cpu_compute.h"
+#include "sim_thread.h"
+#include "aabb_tree.h"
+#include "particles.h"
+#include "frame_uniforms.h"
+
 using glm::fvec2;
 using glm::fvec3;
 // using glm::vec2;
@@ -165,38 +171,20 @@ typedef enum {
   RUNNING
 } GameObjectState;
 
+/* Reaches the shaders through `FrameUniforms`, see `update_frame_uniforms()`. */
 class SunLightObject {
- private:
-  // locs.
-  int dir_loc;
-  int color_loc;
-  int strength_loc;
-
  public:
-  Uint shader;
   vec3 pos;
   vec3 direction;
   vec3 color;
   float strength;
-
-  void init_loc(void) {
-    glUseProgram(shader);
-    dir_loc      = glGetUniformLocation(shader, "sun_direction");
-    color_loc    = glGetUniformLocation(shader, "sun_color");
-    strength_loc = glGetUniformLocation(shader, "sun_strength");
-  }
-
-  void set_uniforms(void) {
-    glUseProgram(shader);
-    glUniform3fv(dir_loc, 1, &direction[0]);
-    glUniform3fv(color_loc, 1, &color[0]);
-    glUniform1f(strength_loc, strength);
-  }
 };
 
 typedef struct {
   /* OpenGL data. */
   Uint shader_program;
+  /* Built from instanced.vert, for `InstancedMesh`. */
+  Uint instanced_program;
   Uint compute_program;
   int view_loc;
   int proj_loc;
@@ -204,6 +192,8 @@ typedef struct {
   mat4 projection;
   CameraObject camera;
   SunLightObject sun;
+  /* Camera and sun constants, uploaded once per frame. */
+  FrameUniformBuffer frame;
   /* Game window size. */
   float width;
   float height;
@@ -215,4 +205,9 @@ typedef struct {
   SDL_GLContext context;
   // Types.
   ComputeObject compute;
+  CpuComputeObject cpu_compute;
+  /* Selected at startup, runs physics with `cpu_compute` instead of `compute`. */
+  bool cpu_physics;
+  /* Bounds of every mesh in the scene, for camera collision and picking. */
+  AabbTree scene;
 } GameObject;
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+/* clang-format off */
+
+/* Constants every draw of a frame shares, the camera and the sun.  They live in one std140 uniform
+ * buffer that is written once per frame and stays bound at `FRAME_UNIFORM_BINDING`, every render shader
+ * includes the `FrameUniforms` block of frame_uniforms.glsl at that binding, so no program has to be set
+ * up for it. */
+
+/* Must match the binding of the `FrameUniforms` block in frame_uniforms.glsl. */
+#define FRAME_UNIFORM_BINDING 0
+
+/* Must match `FrameUniforms` in frame_uniforms.glsl, only mat4 and vec4 members so std140 adds no padding. */
+typedef struct {
+  mat4 view;
+  mat4 projection;
+  /* Camera position, w unused. */
+  vec4 view_position;
+  /* Sun position, w unused, and sun color with the strength in w. */
+  vec4 sun_pos;
+  vec4 sun_color;
+} FrameUniforms;
+
+static_assert(sizeof(FrameUniforms) == 176, "FrameUniforms must match its std140 layout");
+
+class FrameUniformBuffer {
+ private:
+  Uint ubo = 0;
+
+ public:
+  FrameUniforms data;
+
+  void init(void) {
+    glGenBuffers(1, &ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, ubo);
+  }
+
+  /* Upload `data`, once per frame before anything is drawn. */
+  void upload(void) {
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &data);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+
+  void release(void) {
+    if (ubo) {
+      glDeleteBuffers(1, &ubo);
+      ubo = 0;
+    }
+  }
+};
@@ -0,0 +1,141 @@
+#pragma once
+
+/* clang-format off */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "cpu_compute.h"
+#include "aabb_tree.h"
+#include "utils.h"
+
+/* View frustum culling of boxes on the cpu.  The boxes are kept as center and half extent arrays, and
+ * tested against all six planes `CPU_LANES` at a time with the same simd layer as `CpuComputeObject`, so
+ * 8 boxes per step with avx.  A box is outside when it lies fully behind any one plane. */
+
+typedef struct {
+  /* Boxes tested, and found visible, by the last `cull()`, and how long it took. */
+  Uint tested;
+  Uint visible;
+  double micros;
+  /* Totals over every `cull()`. */
+  Ulong frames;
+  Ulong total_visible;
+  double total_micros;
+} FrustumCullStats;
+
+class FrustumCuller {
+ private:
+  /* Padded up to a multiple of `CPU_LANES`, the padding is never reported as visible. */
+  MVector<float> cx, cy, cz;
+  MVector<float> ex, ey, ez;
+  Uint count = 0;
+  MVector<Uint> visible;
+
+  /* Whether the box lies fully behind `plane`, its corner furthest along the normal is still behind it. */
+  static bool box_outside(const vec4 &plane, const float *c, const float *e) {
+    float dist   = ((plane.x * c[0]) + (plane.y * c[1]) + (plane.z * c[2]) + plane.w);
+    float radius = ((fabsf(plane.x) * e[0]) + (fabsf(plane.y) * e[1]) + (fabsf(plane.z) * e[2]));
+    return ((dist + radius) < 0.0f);
+  }
+
+ public:
+  FrustumCullStats stats = {};
+
+  void clear(void) {
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    ex.clear();
+    ey.clear();
+    ez.clear();
+    count = 0;
+  }
+
+  /* Add a box, returns the index it is reported by in `visible_list()`. */
+  Uint add(const Aabb &box) {
+    /* Drop the padding of the last `cull()`. */
+    if (cx.size() != count) {
+      MVector<float> *arrays[6] = {&cx, &cy, &cz, &ex, &ey, &ez};
+      for (auto *array : arrays) {
+        array->resize(count);
+      }
+    }
+    vec3 center = aabb_center(box);
+    vec3 half   = (aabb_size(box) * 0.5f);
+    cx.push_back(center.x);
+    cy.push_back(center.y);
+    cz.push_back(center.z);
+    ex.push_back(half.x);
+    ey.push_back(half.y);
+    ez.push_back(half.z);
+    return count++;
+  }
+
+  /* Test every box against the frustum of `view_projection`, and collect the visible ones in ascending order. */
+  void cull(const mat4 &view_projection) {
+    time_point start = high_resolution_clock::now();
+    vec4 planes[6];
+    frustum_planes(view_projection, planes);
+    visible.clear();
+    Uint padded = (((count + CPU_LANES - 1) / CPU_LANES) * CPU_LANES);
+    MVector<float> *arrays[6] = {&cx, &cy, &cz, &ex, &ey, &ez};
+    for (auto *array : arrays) {
+      array->resize(padded);
+      for (Uint i = count; i < padded; ++i) {
+        (*array)[i] = 0.0f;
+      }
+    }
+    Uint i = 0;
+  #if CPU_LANES > 1
+    const simd_float zero = simd_set1(0.0f);
+    for (; i < padded; i += CPU_LANES) {
+      simd_float c[3] = {simd_load(&cx[i]), simd_load(&cy[i]), simd_load(&cz[i])};
+      simd_float e[3] = {simd_load(&ex[i]), simd_load(&ey[i]), simd_load(&ez[i])};
+      simd_float outside = simd_cmplt(zero, zero);
+      for (Uint p = 0; p < 6; ++p) {
+        const vec4 &pl = planes[p];
+        simd_float dist = simd_add(simd_add(simd_mul(simd_set1(pl.x), c[0]), simd_mul(simd_set1(pl.y), c[1])),
+                                   simd_add(simd_mul(simd_set1(pl.z), c[2]), simd_set1(pl.w)));
+        simd_float radius = simd_add(simd_add(simd_mul(simd_set1(fabsf(pl.x)), e[0]), simd_mul(simd_set1(fabsf(pl.y)), e[1])),
+                                     simd_mul(simd_set1(fabsf(pl.z)), e[2]));
+        outside = simd_or(outside, simd_cmplt(simd_add(dist, radius), zero));
+      }
+      Uint mask = (~(Uint)simd_movemask(outside) & ((1u << CPU_LANES) - 1));
+      while (mask) {
+        Uint lane = __builtin_ctz(mask);
+        if ((i + lane) < count) {
+          visible.push_back(i + lane);
+        }
+        mask &= (mask - 1);
+      }
+    }
+  #endif
+    for (; i < count; ++i) {
+      const float c[3] = {cx[i], cy[i], cz[i]};
+      const float e[3] = {ex[i], ey[i], ez[i]};
+      bool outside = false;
+      for (Uint p = 0; p < 6 && !outside; ++p) {
+        outside = box_outside(planes[p], c, e);
+      }
+      if (!outside) {
+        visible.push_back(i);
+      }
+    }
+    stats.tested  = count;
+    stats.visible = visible.size();
+    stats.micros  = duration<double, std::micro>(high_resolution_clock::now() - start).count();
+    ++stats.frames;
+    stats.total_visible += stats.visible;
+    stats.total_micros  += stats.micros;
+  }
+
+  const MVector<Uint> &visible_list(void) const {
+    return visible;
+  }
+
+  void report(FILE *out = stdout) const {
+    double frames = (stats.frames ? (double)stats.frames : 1.0);
+    fprintf(out, "frustum cull: %lu frames, %.1f visible, %.3f us per frame\n", stats.frames, (stats.total_visible / frames), (stats.total_micros / frames));
+  }
+};
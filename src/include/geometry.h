@@ -0,0 +1,251 @@
+#pragma once
+
+/* clang-format off */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <unordered_map>
+
+#include "def.h"
+#include "utils.h"
+
+/* Shared storage for all mesh geometry.  Every shape is uploaded once, keyed by a hash of its content,
+ * into one large vertex buffer and one large index buffer, and meshes only keep a handle to their range
+ * of it.  All meshes then draw from the same few vaos, with `glDrawElementsBaseVertex()`. */
+
+/* Position and normal, the layout every mesh uses. */
+#define GEOMETRY_VERTEX_FLOATS 6
+#define GEOMETRY_VERTEX_STRIDE (GEOMETRY_VERTEX_FLOATS * sizeof(float))
+/* Initial capacity of the arena buffers, they double when full. */
+#define GEOMETRY_INITIAL_VERTICES (1 << 16)
+#define GEOMETRY_INITIAL_INDICES  (1 << 18)
+
+/* Per instance attributes of instanced.vert, the model matrix takes locations 2 to 5, the color 6, and
+ * the normal matrix 7 to 9.  The normal matrix columns are padded to vec4. */
+typedef struct {
+  mat4 model;
+  vec4 color;
+  vec4 normal[3];
+} InstanceData;
+
+#define INSTANCE_MODEL_LOC  2
+#define INSTANCE_COLOR_LOC  6
+#define INSTANCE_NORMAL_LOC 7
+
+/* Per instance body index of body.vert, fed from the visible list of the cull pass, see indirect.h. */
+#define INDIRECT_BODY_LOC 10
+
+/* Vertex buffer binding of the instance buffer in the instanced vao, see `InstancedMesh`, and of the
+ * visible body list in the indirect vao. */
+#define GEOMETRY_INSTANCE_BINDING 1
+#define GEOMETRY_INDIRECT_BINDING 2
+
+/* The vaos of the arena, they all read the same vertex and index buffers, and only differ in their per
+ * instance attributes. */
+enum GeometryVao {
+  GEOMETRY_VAO_PLAIN,
+  GEOMETRY_VAO_INSTANCED,
+  GEOMETRY_VAO_INDIRECT,
+  GEOMETRY_VAO_COUNT
+};
+
+typedef struct {
+  /* Added to every index, and where the indices start in the index buffer. */
+  Uint base_vertex;
+  Uint first_index;
+  Uint index_count;
+  /* Size of the shape, see `verts_size_vec()`. */
+  vec3 size;
+} GeometryHandle;
+
+class GeometryArena {
+ private:
+  typedef struct {
+    GeometryHandle handle;
+    Uint vertex_count;
+  } Entry;
+
+  Uint VAO[GEOMETRY_VAO_COUNT] = {};
+  Uint VBO = 0;
+  Uint EBO = 0;
+  Uint vertex_capacity = 0;
+  Uint index_capacity = 0;
+  Uint vertex_count = 0;
+  Uint index_count = 0;
+  /* How many `get()` calls were served from the cache instead of uploading. */
+  Uint reused = 0;
+  std::unordered_map<Ulong, Entry> cache;
+
+  /* Fnv-1a over the raw bytes of the vertices and indices. */
+  static Ulong content_hash(const MVector<float> &verts, const MVector<Uint> &indices) {
+    Ulong hash = 14695981039346656037ull;
+    auto feed = [&](const void *data, Ulong size) {
+      for (Ulong i = 0; i < size; ++i) {
+        hash = ((hash ^ ((const Uchar *)data)[i]) * 1099511628211ull);
+      }
+    };
+    feed(verts.data(), (verts.size() * sizeof(float)));
+    feed(indices.data(), (indices.size() * sizeof(Uint)));
+    return hash;
+  }
+
+  /* Point every vao at the current buffers. */
+  void attach_buffers(void) {
+    for (Uint v = 0; v < GEOMETRY_VAO_COUNT; ++v) {
+      glBindVertexArray(VAO[v]);
+      glBindVertexBuffer(0, VBO, 0, GEOMETRY_VERTEX_STRIDE);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    }
+    glBindVertexArray(0);
+  }
+
+  /* Replace `*buffer` with one of `new_size` bytes, keeping the first `used` bytes. */
+  static void grow_buffer(Uint *buffer, Ulong used, Ulong new_size) {
+    Uint grown;
+    glGenBuffers(1, &grown);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+    glBufferData(GL_COPY_WRITE_BUFFER, new_size, nullptr, GL_STATIC_DRAW);
+    if (*buffer) {
+      glBindBuffer(GL_COPY_READ_BUFFER, *buffer);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+      glDeleteBuffers(1, buffer);
+    }
+    *buffer = grown;
+  }
+
+  /* Make room for `vertices` more vertices and `indices` more indices. */
+  void reserve(Uint vertices, Uint indices) {
+    bool grown = false;
+    if (!vertex_capacity || (vertex_count + vertices) > vertex_capacity) {
+      Uint capacity = (vertex_capacity ? vertex_capacity : GEOMETRY_INITIAL_VERTICES);
+      while ((vertex_count + vertices) > capacity) {
+        capacity *= 2;
+      }
+      grow_buffer(&VBO, (vertex_count * GEOMETRY_VERTEX_STRIDE), (capacity * GEOMETRY_VERTEX_STRIDE));
+      vertex_capacity = capacity;
+      grown = true;
+    }
+    if (!index_capacity || (index_count + indices) > index_capacity) {
+      Uint capacity = (index_capacity ? index_capacity : GEOMETRY_INITIAL_INDICES);
+      while ((index_count + indices) > capacity) {
+        capacity *= 2;
+      }
+      grow_buffer(&EBO, (index_count * sizeof(Uint)), (capacity * sizeof(Uint)));
+      index_capacity = capacity;
+      grown = true;
+    }
+    if (grown) {
+      attach_buffers();
+    }
+  }
+
+  void init(void) {
+    glGenVertexArrays(GEOMETRY_VAO_COUNT, VAO);
+    for (Uint v = 0; v < GEOMETRY_VAO_COUNT; ++v) {
+      glBindVertexArray(VAO[v]);
+      /* Position. */
+      glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, 0);
+      glVertexAttribBinding(0, 0);
+      glEnableVertexAttribArray(0);
+      /* Normal. */
+      glVertexAttribFormat(1, 3, GL_FLOAT, GL_FALSE, (3 * sizeof(float)));
+      glVertexAttribBinding(1, 0);
+      glEnableVertexAttribArray(1);
+    }
+    /* Per instance model matrix, one column per attribute location, color, and normal matrix.  The instance buffer
+     * itself is bound by each `InstancedMesh` before it draws. */
+    glBindVertexArray(VAO[GEOMETRY_VAO_INSTANCED]);
+    for (Uint c = 0; c < 4; ++c) {
+      glVertexAttribFormat((INSTANCE_MODEL_LOC + c), 4, GL_FLOAT, GL_FALSE, (offsetof(InstanceData, model) + (c * sizeof(vec4))));
+      glVertexAttribBinding((INSTANCE_MODEL_LOC + c), GEOMETRY_INSTANCE_BINDING);
+      glEnableVertexAttribArray(INSTANCE_MODEL_LOC + c);
+    }
+    glVertexAttribFormat(INSTANCE_COLOR_LOC, 4, GL_FLOAT, GL_FALSE, offsetof(InstanceData, color));
+    glVertexAttribBinding(INSTANCE_COLOR_LOC, GEOMETRY_INSTANCE_BINDING);
+    glEnableVertexAttribArray(INSTANCE_COLOR_LOC);
+    for (Uint c = 0; c < 3; ++c) {
+      glVertexAttribFormat((INSTANCE_NORMAL_LOC + c), 3, GL_FLOAT, GL_FALSE, (offsetof(InstanceData, normal) + (c * sizeof(vec4))));
+      glVertexAttribBinding((INSTANCE_NORMAL_LOC + c), GEOMETRY_INSTANCE_BINDING);
+      glEnableVertexAttribArray(INSTANCE_NORMAL_LOC + c);
+    }
+    glVertexBindingDivisor(GEOMETRY_INSTANCE_BINDING, 1);
+    /* Index of the body to draw, `glMultiDrawElementsIndirect()` offsets it by the base instance of each command. */
+    glBindVertexArray(VAO[GEOMETRY_VAO_INDIRECT]);
+    glVertexAttribIFormat(INDIRECT_BODY_LOC, 1, GL_UNSIGNED_INT, 0);
+    glVertexAttribBinding(INDIRECT_BODY_LOC, GEOMETRY_INDIRECT_BINDING);
+    glEnableVertexAttribArray(INDIRECT_BODY_LOC);
+    glVertexBindingDivisor(GEOMETRY_INDIRECT_BINDING, 1);
+    glBindVertexArray(0);
+  }
+
+ public:
+  /* Handle of the shape made of `verts` and `indices`, uploading it only the first time it is seen. */
+  GeometryHandle get(const MVector<float> &verts, const MVector<Uint> &indices) {
+    Ulong hash = content_hash(verts, indices);
+    Uint verts_count = (verts.size() / GEOMETRY_VERTEX_FLOATS);
+    auto it = cache.find(hash);
+    if (it != cache.end() && it->second.vertex_count == verts_count && it->second.handle.index_count == indices.size()) {
+      ++reused;
+      return it->second.handle;
+    }
+    if (!VAO[0]) {
+      init();
+    }
+    reserve(verts_count, indices.size());
+    GeometryHandle handle = {vertex_count, index_count, (Uint)indices.size(), verts_size_vec(verts)};
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferSubData(GL_ARRAY_BUFFER, (vertex_count * GEOMETRY_VERTEX_STRIDE), (verts.size() * sizeof(float)), verts.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    /* Bound through a vao, so the element buffer binding of the vaos is left alone. */
+    glBindBuffer(GL_COPY_WRITE_BUFFER, EBO);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, (index_count * sizeof(Uint)), (indices.size() * sizeof(Uint)), indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    vertex_count += verts_count;
+    index_count  += indices.size();
+    cache[hash] = {handle, verts_count};
+    return handle;
+  }
+
+  Uint vao(GeometryVao which = GEOMETRY_VAO_PLAIN) const {
+    return VAO[which];
+  }
+
+  void bind(GeometryVao which = GEOMETRY_VAO_PLAIN) {
+    glBindVertexArray(VAO[which]);
+  }
+
+  void draw(const GeometryHandle &handle) {
+    glDrawElementsBaseVertex(GL_TRIANGLES, handle.index_count, GL_UNSIGNED_INT, (void *)(handle.first_index * sizeof(Uint)), handle.base_vertex);
+  }
+
+  void draw_instanced(const GeometryHandle &handle, Uint instances) {
+    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, handle.index_count, GL_UNSIGNED_INT, (void *)(handle.first_index * sizeof(Uint)), instances, handle.base_vertex);
+  }
+
+  /* Delete every gl object, has to run while the context is still alive. */
+  void release(void) {
+    if (!VAO[0]) {
+      return;
+    }
+    glDeleteVertexArrays(GEOMETRY_VAO_COUNT, VAO);
+    glDeleteBuffers(1, &VBO);
+    glDeleteBuffers(1, &EBO);
+    for (Uint v = 0; v < GEOMETRY_VAO_COUNT; ++v) {
+      VAO[v] = 0;
+    }
+    VBO = EBO = 0;
+    vertex_capacity = index_capacity = vertex_count = index_count = 0;
+    cache.clear();
+  }
+
+  void report(FILE *out = stdout) const {
+    fprintf(out, "geometry: %u shapes, %u vertices, %u indices, %lu bytes, %u uploads saved\n", (Uint)cache.size(), vertex_count, index_count,
+      (((Ulong)vertex_capacity * GEOMETRY_VERTEX_STRIDE) + ((Ulong)index_capacity * sizeof(Uint))), reused);
+  }
+};
+
+/* The arena all meshes share, created on first use. */
+inline GeometryArena &geometry_arena(void) {
+  static GeometryArena arena;
+  return arena;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+/* clang-format off */
+
+#include <math.h>
+
+#include "def.h"
+#include "utils.h"
+#include "geometry.h"
+
+/* Gpu driven drawing of the physics bodies.  Each frame CULL_OPERATION of shader.comp tests every body
+ * against the view frustum and writes the visible ones into the instance ranges of one indirect command
+ * per shape, then a single `glMultiDrawElementsIndirect()` draws them all with body.vert, which reads
+ * the positions from the body buffers of `ComputeObject`.  Nothing about the bodies is read back for
+ * drawing, the cpu only supplies the camera. */
+
+/* Must match the bindings of the indirect buffers in shader.comp and body.vert. */
+#define BODY_DRAW_BINDING    21
+#define DRAW_COMMAND_BINDING 22
+#define VISIBLE_BODY_BINDING 23
+#define BODY_SHAPE_BINDING   24
+
+/* Layout `glMultiDrawElementsIndirect()` reads, and `DrawCommand` in shader.comp. */
+typedef struct {
+  Uint count;
+  Uint instance_count;
+  Uint first_index;
+  int  base_vertex;
+  Uint base_instance;
+} DrawElementsIndirectCommand;
+
+/* Must match `BodyDraw` in body_draw.glsl.  `scale.w` is the bounding radius used for culling. */
+typedef struct {
+  vec4 scale;
+  vec4 color;
+} BodyDraw;
+
+static_assert(sizeof(DrawElementsIndirectCommand) == 20 && sizeof(BodyDraw) == 32, "Indirect structs must match their std430 layout");
+
+class IndirectRenderer {
+ private:
+  Uint cull_program = 0;
+  Uint render_program = 0;
+  Uint command_buffer;
+  Uint visible_buffer;
+  Uint draw_buffer;
+  Uint shape_buffer;
+  Uint body_count = 0;
+  Uint local_size = 1;
+  int operation_loc;
+  int frustum_loc;
+  int cull_loc;
+  /* The commands with every instance count at zero, copied over the command buffer before each cull pass. */
+  MVector<DrawElementsIndirectCommand> commands;
+
+ public:
+  /* Frustum cull the bodies on the gpu, otherwise every body is drawn. */
+  bool cull = true;
+
+  ~IndirectRenderer(void) {
+    if (!cull_program) {
+      return;
+    }
+    glDeleteBuffers(1, &command_buffer);
+    glDeleteBuffers(1, &visible_buffer);
+    glDeleteBuffers(1, &draw_buffer);
+    glDeleteBuffers(1, &shape_buffer);
+    glDeleteProgram(cull_program);
+    glDeleteProgram(render_program);
+  }
+
+  /* Whether the driver allows the storage buffers this needs, body.vert reads the body state and draw
+   * buffers, so the vertex stage needs storage blocks, which the spec does not guarantee. */
+  static bool supported(bool soa) {
+    int bindings;
+    int vertex_blocks;
+    glGetIntegerv(GL_MAX_SHADER_STORAGE_BUFFER_BINDINGS, &bindings);
+    glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &vertex_blocks);
+    return (bindings > BODY_SHAPE_BINDING && (Uint)vertex_blocks >= (body_buffer_count(BODY_SET_IN, soa) + 1));
+  }
+
+  /* `cull_program` is a compute program built from shader.comp, and `render_program` one built from
+   * body.vert and shader.frag by `create_body_shader_program()`, both with the layout of the program that
+   * runs the physics, and both finished, see `finish_shader_programs()`.  Body `i` is drawn as
+   * `shapes[body_shape[i]]` scaled by `scale[i]`. */
+  void init(Uint cull_program, Uint render_program, const MVector<GeometryHandle> &shapes, const MVector<Uint> &body_shape,
+            const MVector<vec3> &scale, const MVector<vec3> &color) {
+    this->cull_program   = cull_program;
+    this->render_program = render_program;
+    body_count = body_shape.size();
+    int group_size[3];
+    glGetProgramiv(cull_program, GL_COMPUTE_WORK_GROUP_SIZE, group_size);
+    local_size    = (Uint)group_size[0];
+    operation_loc = glGetUniformLocation(cull_program, "operation");
+    frustum_loc   = glGetUniformLocation(cull_program, "frustum");
+    cull_loc      = glGetUniformLocation(cull_program, "cull");
+    /* Each shape gets a range of the visible list as large as its number of bodies. */
+    commands.resize(shapes.size());
+    for (Uint s = 0; s < shapes.size(); ++s) {
+      commands[s] = {shapes[s].index_count, 0, shapes[s].first_index, (int)shapes[s].base_vertex, 0};
+    }
+    for (Uint i = 0; i < body_count; ++i) {
+      for (Uint s = (body_shape[i] + 1); s < shapes.size(); ++s) {
+        ++commands[s].base_instance;
+      }
+    }
+    MVector<BodyDraw> draw;
+    draw.resize(body_count);
+    for (Uint i = 0; i < body_count; ++i) {
+      vec3 extent = (shapes[body_shape[i]].size * scale[i]);
+      float radius = (0.5f * sqrtf((extent.x * extent.x) + (extent.y * extent.y) + (extent.z * extent.z)));
+      draw[i] = {vec4(scale[i].x, scale[i].y, scale[i].z, radius), vec4(color[i].x, color[i].y, color[i].z, 1.0f)};
+    }
+    glGenBuffers(1, &command_buffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, (commands.size() * sizeof(DrawElementsIndirectCommand)), commands.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glGenBuffers(1, &visible_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, visible_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (body_count * sizeof(Uint)), nullptr, GL_DYNAMIC_COPY);
+    glGenBuffers(1, &draw_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, draw_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (body_count * sizeof(BodyDraw)), draw.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &shape_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, shape_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (body_count * sizeof(Uint)), body_shape.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  /* Cull and draw every body from the body buffers that are bound right now, call after the frame uniforms
+   * were updated.  `view_projection` has to be the same camera those hold. */
+  void draw(const mat4 &view_projection) {
+    if (!body_count) {
+      return;
+    }
+    /* Start every command over at zero instances. */
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, (commands.size() * sizeof(DrawElementsIndirectCommand)), commands.data());
+    vec4 planes[6];
+    frustum_planes(view_projection, planes);
+    glUseProgram(cull_program);
+    glUniform4fv(frustum_loc, 6, &planes[0][0]);
+    glUniform1i(cull_loc, cull);
+    glUniform1ui(operation_loc, CULL_OPERATION);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BODY_DRAW_BINDING,    draw_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_COMMAND_BINDING, command_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_BODY_BINDING, visible_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BODY_SHAPE_BINDING,   shape_buffer);
+    glDispatchCompute(((body_count + local_size - 1) / local_size), 1, 1);
+    /* The commands are read as indirect arguments, and the visible list as a vertex attribute. */
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    glUseProgram(render_program);
+    geometry_arena().bind(GEOMETRY_VAO_INDIRECT);
+    glBindVertexBuffer(GEOMETRY_INDIRECT_BINDING, visible_buffer, 0, sizeof(Uint));
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, commands.size(), 0);
+    glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+/* clang-format off */
+
+#include "def.h"
+#include "utils.h"
+#include "geometry.h"
+#include "render_queue.h"
+
+/* Many copies of one shape, taken from the geometry arena.  Every instance only adds a model matrix and
+ * a color to the instance buffer, and all of them are drawn with one `glDrawElementsInstancedBaseVertex()`. */
+class InstancedMesh {
+ private:
+  GeometryHandle geometry;
+  Uint instance_VBO;
+  /* Instances the instance buffer has room for, it only grows. */
+  Uint instance_capacity = 0;
+  /* Set when `instances` changed since the last upload. */
+  bool dirty = true;
+
+  /* Copy `instances` into the instance buffer, growing it to twice the size when it is too small. */
+  void upload(void) {
+    if (!dirty) {
+      return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, instance_VBO);
+    if (instances.size() > instance_capacity) {
+      instance_capacity = (instances.size() * 2);
+      glBufferData(GL_ARRAY_BUFFER, (instance_capacity * sizeof(InstanceData)), nullptr, GL_DYNAMIC_DRAW);
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, 0, (instances.size() * sizeof(InstanceData)), instances.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    dirty = false;
+  }
+
+ public:
+  Uint shader_program;
+  /* Size of the shape before scaling, the same as `Mesh::size`. */
+  vec3 size;
+  MVector<InstanceData> instances;
+
+  /* `shader_program` has to be built from instanced.vert. */
+  InstancedMesh(const MVector<float> &verts, const MVector<Uint> &indices, Uint shader_program)
+    :
+    geometry(geometry_arena().get(verts, indices)),
+    shader_program(shader_program),
+    size(geometry.size)
+  {
+    /* Attached to the instanced vao of the arena on every draw. */
+    glGenBuffers(1, &instance_VBO);
+  }
+
+  /* Owns the instance buffer, so it can not be copied. */
+  InstancedMesh(const InstancedMesh &) = delete;
+  InstancedMesh &operator=(const InstancedMesh &) = delete;
+
+  ~InstancedMesh(void) {
+    glDeleteBuffers(1, &instance_VBO);
+  }
+
+  /* Set instance `i`, with the same model matrix `Mesh::update_model()` builds, see `model_matrix()`. */
+  void set(Uint i, const vec3 &pos, const vec3 &rotation, const vec3 &scale, const vec3 &color) {
+    vec3 normal[3];
+    instances[i].model = model_matrix(pos, rotation, scale, normal);
+    instances[i].color = vec4(color.x, color.y, color.z, 1.0f);
+    for (Uint c = 0; c < 3; ++c) {
+      instances[i].normal[c] = vec4(normal[c].x, normal[c].y, normal[c].z, 0.0f);
+    }
+    dirty = true;
+  }
+
+  /* Add an instance, returns its index. */
+  Uint add(const vec3 &pos, const vec3 &rotation, const vec3 &scale, const vec3 &color) {
+    instances.push_back({});
+    set((instances.size() - 1), pos, rotation, scale, color);
+    return (instances.size() - 1);
+  }
+
+  void clear(void) {
+    instances.clear();
+    dirty = true;
+  }
+
+  /* World space bounds of instance `i`, scaled and rotated the same way as `Mesh::bounds()`. */
+  Aabb bounds(Uint i) const {
+    const mat4 &m = instances[i].model;
+    /* Extent of the transformed box along each axis, the columns of `m` already hold the scale. */
+    vec3 extent(((fabsf(m[0].x) * size.x) + (fabsf(m[1].x) * size.y) + (fabsf(m[2].x) * size.z)),
+                ((fabsf(m[0].y) * size.x) + (fabsf(m[1].y) * size.y) + (fabsf(m[2].y) * size.z)),
+                ((fabsf(m[0].z) * size.x) + (fabsf(m[1].z) * size.y) + (fabsf(m[2].z) * size.z)));
+    return aabb_from_box(mat_position_vec(m), extent);
+  }
+
+  /* Queue every instance as a single packet. */
+  void submit(RenderQueue *queue) {
+    upload();
+    queue->submit_instanced(shader_program, geometry, instance_VBO, instances.size());
+  }
+
+  /* Draw every instance with a single draw call. */
+  void draw(GameObject *game) {
+    if (instances.empty()) {
+      return;
+    }
+    upload();
+    glUseProgram(shader_program);
+    geometry_arena().bind(GEOMETRY_VAO_INSTANCED);
+    glBindVertexBuffer(GEOMETRY_INSTANCE_BINDING, instance_VBO, 0, sizeof(InstanceData));
+    geometry_arena().draw_instanced(geometry, instances.size());
+    glBindVertexArray(0);
+  }
+};
@@ -0,0 +1,331 @@
+#pragma once
+
+/* clang-format off */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <Mlib/Vector.h>
+
+/* Logging that never blocks the thread that logs.  `LOG_INFO(fmt, ...)` and friends copy the format
+ * pointer, the raw arguments and a timestamp into a fixed size record, and push it into a single producer,
+ * single consumer ring owned by the calling thread.  Nothing is formatted or allocated there, a full ring
+ * drops the record and counts it.  One background thread drains every ring, formats the records printf
+ * style and writes them out, so a slow terminal or pipe only ever stalls that thread.
+ *
+ * The format has to be a string literal.  String arguments are copied into the record, everything else
+ * is stored as a 64 bit integer or a double, so length modifiers in the format do not matter. */
+
+#define LOG_RING_SIZE  1024
+#define LOG_MAX_ARGS   8
+#define LOG_TEXT_BYTES 128
+
+enum LogLevel {
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_ERROR
+};
+
+typedef struct {
+  Ulong nanos;
+  const char *fmt;
+  Uchar level;
+  Uchar argc;
+  /* 'i' signed, 'u' unsigned, 'f' double, 's' offset into `text`. */
+  char types[LOG_MAX_ARGS];
+  union {
+    long long i;
+    unsigned long long u;
+    double f;
+  } args[LOG_MAX_ARGS];
+  Uint text_used;
+  char text[LOG_TEXT_BYTES];
+} LogRecord;
+
+/* Written by its thread, read by the log thread. */
+class LogRing {
+ private:
+  LogRecord records[LOG_RING_SIZE];
+  std::atomic<Uint> head{0};
+  std::atomic<Uint> tail{0};
+
+ public:
+  std::atomic<Ulong> dropped{0};
+
+  /* The record to fill in, or nullptr when the ring is full. */
+  LogRecord *reserve(void) {
+    Uint h = head.load(std::memory_order_relaxed);
+    if ((h - tail.load(std::memory_order_acquire)) == LOG_RING_SIZE) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &records[h % LOG_RING_SIZE];
+  }
+
+  void commit(void) {
+    head.store((head.load(std::memory_order_relaxed) + 1), std::memory_order_release);
+  }
+
+  const LogRecord *front(void) {
+    Uint t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &records[t % LOG_RING_SIZE];
+  }
+
+  void pop(void) {
+    tail.store((tail.load(std::memory_order_relaxed) + 1), std::memory_order_release);
+  }
+};
+
+class Logger {
+ private:
+  std::mutex rings_mutex;
+  std::vector<LogRing *> rings;
+  std::thread thread;
+  std::atomic<bool> running{false};
+  std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+  Ulong written = 0;
+
+  /* Format `r` into `out`, one conversion at a time with the argument it was given. */
+  static void format(const LogRecord &r, FILE *out) {
+    static const char *level_names[] = {"info", "warn", "error"};
+    fprintf(out, "[%10.3f %s] ", (r.nanos / 1e9), level_names[r.level]);
+    const char *p = r.fmt;
+    Uint arg = 0;
+    while (*p) {
+      if (*p != '%') {
+        fputc(*p++, out);
+        continue;
+      }
+      if (p[1] == '%') {
+        fputc('%', out);
+        p += 2;
+        continue;
+      }
+      /* Flags, width and precision are kept, length modifiers replaced with what the stored type needs. */
+      char spec[32] = "%";
+      Uint len = 1;
+      ++p;
+      while (*p && !strchr("diouxXeEfFgGaAcsp", *p)) {
+        if (!strchr("hlLqjzt", *p) && len < (sizeof(spec) - 4)) {
+          spec[len++] = *p;
+        }
+        ++p;
+      }
+      char conv = *p;
+      if (!conv) {
+        break;
+      }
+      ++p;
+      if (arg >= r.argc) {
+        fputs("<missing>", out);
+        continue;
+      }
+      char type = r.types[arg];
+      if (strchr("diouxXc", conv)) {
+        if (conv != 'c') {
+          spec[len++] = 'l';
+          spec[len++] = 'l';
+        }
+        spec[len++] = conv;
+        spec[len] = '\0';
+        if (type == 'f') {
+          fprintf(out, spec, (long long)r.args[arg].f);
+        }
+        else if (conv == 'c') {
+          fprintf(out, spec, (int)r.args[arg].i);
+        }
+        else {
+          fprintf(out, spec, r.args[arg].i);
+        }
+      }
+      else if (strchr("eEfFgGaA", conv)) {
+        spec[len++] = conv;
+        spec[len] = '\0';
+        fprintf(out, spec, ((type == 'f') ? r.args[arg].f : (type == 'u') ? (double)r.args[arg].u : (double)r.args[arg].i));
+      }
+      else if (conv == 's') {
+        spec[len++] = 's';
+        spec[len] = '\0';
+        fprintf(out, spec, ((type == 's') ? (r.text + r.args[arg].u) : "<not a string>"));
+      }
+      else {
+        spec[len++] = 'p';
+        spec[len] = '\0';
+        fprintf(out, spec, (void *)(uintptr_t)r.args[arg].u);
+      }
+      ++arg;
+    }
+  }
+
+  /* Write out everything that is queued, returns whether there was anything.  Records of one thread come
+   * out in order, records of different threads only roughly, by the timestamp they carry. */
+  bool drain(void) {
+    bool any = false;
+    /* Rings are only ever added, the lock is not held while writing, so a thread logging for the first
+     * time never waits on the output. */
+    std::vector<LogRing *> current;
+    {
+      std::lock_guard<std::mutex> lock(rings_mutex);
+      current = rings;
+    }
+    for (LogRing *ring : current) {
+      while (const LogRecord *r = ring->front()) {
+        FILE *out = ((r->level == LOG_LEVEL_INFO) ? stdout : stderr);
+        format(*r, out);
+        ring->pop();
+        ++written;
+        any = true;
+      }
+    }
+    if (any) {
+      fflush(stdout);
+      fflush(stderr);
+    }
+    return any;
+  }
+
+  void run(void) {
+    while (running.load(std::memory_order_acquire)) {
+      if (!drain()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }
+    drain();
+  }
+
+ public:
+  ~Logger(void) {
+    stop();
+    for (LogRing *ring : rings) {
+      delete ring;
+    }
+  }
+
+  void start(void) {
+    if (!running.exchange(true)) {
+      thread = std::thread([this] { run(); });
+    }
+  }
+
+  /* Write out what is left and stop the log thread, records pushed after this are written right away. */
+  void stop(void) {
+    if (running.exchange(false)) {
+      thread.join();
+    }
+    drain();
+  }
+
+  bool is_running(void) const {
+    return running.load(std::memory_order_relaxed);
+  }
+
+  Ulong nanos(void) const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  /* The ring of the calling thread, created the first time the thread logs. */
+  LogRing *ring(void) {
+    thread_local LogRing *mine = nullptr;
+    if (!mine) {
+      mine = new LogRing;
+      std::lock_guard<std::mutex> lock(rings_mutex);
+      rings.push_back(mine);
+    }
+    return mine;
+  }
+
+  /* Write a record right away, for when the log thread is not running. */
+  void write_now(const LogRecord &r) {
+    format(r, ((r.level == LOG_LEVEL_INFO) ? stdout : stderr));
+  }
+
+  void report(FILE *out = stdout) {
+    Ulong dropped = 0;
+    {
+      std::lock_guard<std::mutex> lock(rings_mutex);
+      for (LogRing *ring : rings) {
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+      }
+    }
+    fprintf(out, "log: %lu records written, %lu dropped\n", written, dropped);
+  }
+};
+
+inline Logger &logger(void) {
+  static Logger l;
+  return l;
+}
+
+/* Store one argument in `r`, strings are copied into its text, truncated or left empty when it is full. */
+template <typename T>
+inline void log_arg(LogRecord *r, T value) {
+  Uint i = r->argc++;
+  if constexpr (std::is_same_v<std::decay_t<T>, const char *> || std::is_same_v<std::decay_t<T>, char *>) {
+    r->types[i] = 's';
+    const char *s = (value ? value : "(null)");
+    /* The last byte is kept as an empty string, for the strings that no longer fit at all. */
+    Uint room = ((LOG_TEXT_BYTES - 1) - r->text_used);
+    if (!room) {
+      r->args[i].u = (LOG_TEXT_BYTES - 1);
+      r->text[LOG_TEXT_BYTES - 1] = '\0';
+      return;
+    }
+    Uint n = (Uint)strnlen(s, (room - 1));
+    memcpy((r->text + r->text_used), s, n);
+    r->text[r->text_used + n] = '\0';
+    r->args[i].u = r->text_used;
+    r->text_used += (n + 1);
+  }
+  else if constexpr (std::is_floating_point_v<T>) {
+    r->types[i] = 'f';
+    r->args[i].f = (double)value;
+  }
+  else if constexpr (std::is_pointer_v<T>) {
+    r->types[i] = 'u';
+    r->args[i].u = (uintptr_t)value;
+  }
+  else if constexpr (std::is_signed_v<T> || std::is_enum_v<T>) {
+    r->types[i] = 'i';
+    r->args[i].i = (long long)value;
+  }
+  else {
+    r->types[i] = 'u';
+    r->args[i].u = (unsigned long long)value;
+  }
+}
+
+template <typename... Args>
+inline void log_push(Uchar level, const char *fmt, Args... args) {
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many log arguments");
+  Logger &l = logger();
+  LogRecord local;
+  LogRecord *r = (l.is_running() ? l.ring()->reserve() : &local);
+  if (!r) {
+    return;
+  }
+  r->nanos     = l.nanos();
+  r->fmt       = fmt;
+  r->level     = level;
+  r->argc      = 0;
+  r->text_used = 0;
+  (log_arg(r, args), ...);
+  if (r == &local) {
+    l.write_now(local);
+  }
+  else {
+    l.ring()->commit();
+  }
+}
+
+#define LOG_INFO(...)  log_push(LOG_LEVEL_INFO,  __VA_ARGS__)
+#define LOG_WARN(...)  log_push(LOG_LEVEL_WARN,  __VA_ARGS__)
+#define LOG_ERROR(...) log_push(LOG_LEVEL_ERROR, __VA_ARGS__)
@@ -4,11 +4,13 @@
 
 #include "def.h"
 #include "utils.h"
+#include "instancing.h"
+#include "render_queue.h"
 
 class Mesh;
 
 __INLINE_NAMESPACE(MeshTools) {
-  static __INLINE_CONSTEXPR_VOID check_camera_collision(CameraObject *camera, Mesh *mesh);
+  inline void check_camera_collision(CameraObject *camera, AabbTree *scene);
 }
 
 /* Mesh flags. */
@@ -19,28 +21,24 @@ __INLINE_NAMESPACE(MeshTools) {
 #define MESH_UNSET(mesh, flag)   MESH_FLAGS(mesh, flag) &= ~MESH_FLAGPOS(mesh, flag)
 #define MESH_TOGGLE(mesh, flag)  MESH_FLAGS(mesh, flag) ^= MESH_FLAGPOS(mesh, flag)
 
-#define STATIC_MESH 1
-
 class Mesh {
  private:
-  Uint VAO;
-  Uint VBO;
-  Uint EBO;
-  Uint indices_count;
+  /* Range of the shared geometry arena this mesh draws. */
+  GeometryHandle geometry;
   int color_loc;
   int model_loc;
-  int view_loc;
-  int projection_loc;
+  int normal_matrix_loc;
   int expansion_factor_loc;
-  int scale_loc;
-  int rotation_loc;
-  int pos_loc;
 
  public:
   int flags[2];
+  /* Leaf of this mesh in `GameObject::scene`, or `AABB_NULL_NODE` when not added. */
+  int proxy = AABB_NULL_NODE;
 
   Uint shader_program;
   mat4 model;
+  /* Columns of the inverse transpose of `model`, updated along with it. */
+  vec3 normal[3];
   vec3 color;
   float expansion_factor;
   vec3 pos;
@@ -59,85 +57,77 @@ class Mesh {
        const vec3 &rotation = {},
        float expansion = 0.0f)
     :
-    indices_count(indices.size()),
+    geometry(geometry_arena().get(verts, indices)),
+    /* Awake, with no steps at rest, see `SLEEPING_MESH`. */
+    flags{},
     shader_program(shader_program),
     model(1.0f),
     color(color),
     expansion_factor(expansion),
     pos(pos),
     vel(0.0f),
-    rotation(0.0f),
-    size(verts_size_vec(verts)),
+    accel(0.0f),
+    rotation(rotation),
+    size(geometry.size),
     _scale(1.0f)
   {
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
-    glBindVertexArray(VAO);
-    /* Set up VBO. */
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(float), verts.data(), GL_STATIC_DRAW);
-    /* Set up EBO. */
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(Uint), indices.data(), GL_STATIC_DRAW);
-    /* Set up vertex attrribute pointers. */
-    /* Position. */
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    /* Normal. */
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-    /* Unbind VAO. */
-    glBindVertexArray(0);
     /* Retrieve color uniform from shader. */
     color_loc      = glGetUniformLocation(shader_program, "input_color");
     /* Retrive uniforms from shader. */
-    model_loc      = glGetUniformLocation(shader_program, "model");
-    view_loc       = glGetUniformLocation(shader_program, "view");
-    projection_loc = glGetUniformLocation(shader_program, "projection");
+    model_loc         = glGetUniformLocation(shader_program, "model");
+    normal_matrix_loc = glGetUniformLocation(shader_program, "normal_matrix");
     /* Retrive expansion factor. */
     expansion_factor_loc = glGetUniformLocation(shader_program, "expansion_factor");
-    scale_loc    = glGetUniformLocation(shader_program, "scale");
-    rotation_loc = glGetUniformLocation(shader_program, "rotation");
-    pos_loc      = glGetUniformLocation(shader_program, "pos");
-  }
-
-  ~Mesh(void) {
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteBuffers(1, &EBO);
   }
 
   void set_model_matrix(const mat4 &matrix) {
     model = matrix;
   }
 
+  /* Scale, then rotate, then translate, see `model_matrix()`.  The normal matrix is worked out here once per
+   * object, instead of for every vertex in shader.vert. */
+  void update_model(void) {
+    model = model_matrix(pos, rotation, _scale, normal);
+  }
+
+  /* Queue this mesh instead of drawing it right away.  Only the model matrix and color go with it, the
+   * other uniforms of `draw()` are not read by shader.vert. */
+  void submit(RenderQueue *queue) {
+    update_model();
+    queue->submit(shader_program, geometry, model, normal, color);
+  }
+
   void draw(GameObject *game) {
-    set_sun_direction(game, this->pos);
-    set_sun_light_uniforms(game);
-    check_camera_collision(&game->camera, this);
+    /* Camera and sun come from the frame uniform buffer, only per object data is sent here. */
     glUseProgram(shader_program);
-    glUniform3fv(rotation_loc, 1, &rotation[0]);
-    glUniform3fv(pos_loc, 1, &pos[0]);
     /* Pass color to shader. */
     glUniform3fv(color_loc, 1, &color[0]);
-    /* Pass _scale vec3 to the shader. */
-    glUniform3fv(scale_loc, 1, &_scale[0]);
     /* Pass matrices to shader. */
-    model = mat4(1.0f);
-    model = scale_matrix(model, _scale);
-    model = translate_matrix(model, pos);
-    glUniformMatrix4fv(model_loc,      1, GL_FALSE, &model[0][0]);
-    glUniformMatrix4fv(view_loc,       1, GL_FALSE, &game->camera.view[0][0]);
-    glUniformMatrix4fv(projection_loc, 1, GL_FALSE, &game->projection[0][0]);
+    update_model();
+    glUniformMatrix4fv(model_loc,         1, GL_FALSE, &model[0][0]);
+    glUniformMatrix3fv(normal_matrix_loc, 1, GL_FALSE, &normal[0].x);
     /* Pass expansion factor to shader */
     glUniform1f(expansion_factor_loc, expansion_factor);
     /* Draw the mesh. */
-    glBindVertexArray(VAO);
-    glDrawElements(GL_TRIANGLES, indices_count, GL_UNSIGNED_INT, 0);
+    geometry_arena().bind();
+    geometry_arena().draw(geometry);
     glBindVertexArray(0);
   }
 
+  /* World space bounds, scaled and rotated the same way as the model matrix. */
+  Aabb bounds(void) const {
+    vec3 extent = (size * _scale);
+    if (rotation.x != 0.0f || rotation.y != 0.0f || rotation.z != 0.0f) {
+      /* Extent of the rotated box along each axis. */
+      mat4 r = rotation_matrix(rotation);
+      vec3 e = extent;
+      extent = vec3(((fabsf(r[0].x) * e.x) + (fabsf(r[1].x) * e.y) + (fabsf(r[2].x) * e.z)),
+                    ((fabsf(r[0].y) * e.x) + (fabsf(r[1].y) * e.y) + (fabsf(r[2].y) * e.z)),
+                    ((fabsf(r[0].z) * e.x) + (fabsf(r[1].z) * e.y) + (fabsf(r[2].z) * e.z)));
+    }
+    return aabb_from_box(pos, extent);
+  }
+
   ComputeData compute_data(void) const {
     ComputeData cd;
     cd.pos   = this->pos;
@@ -234,11 +224,16 @@ __INLINE_NAMESPACE(MeshTools) {
     }
   }
 
-  __INLINE_CONSTEXPR_VOID check_camera_collision(CameraObject *camera, Mesh *mesh) {
+  /* Push the camera out of `box` along the axis of least overlap. */
+  __INLINE_CONSTEXPR_VOID resolve_camera_collision(CameraObject *camera, const Aabb &box) {
+    struct {
+      vec3 pos;
+      vec3 size;
+    } mesh_box = {aabb_center(box), aabb_size(box)}, *mesh = &mesh_box;
     if (MESH_COLLIDING(camera, mesh)) {
       if (MESH_OVERLAP_LEAST_L(camera, mesh)) {
         camera->pos.x = (MESH_L(mesh) - (camera->size.x / 2));
-        camera->pos.x = 0.0f;
+        camera->vel.x = 0.0f;
       }
       else if (MESH_OVERLAP_LEAST_R(camera, mesh)) {
         camera->pos.x = (MESH_R(mesh) + (camera->size.x / 2));
@@ -262,6 +257,44 @@ __INLINE_NAMESPACE(MeshTools) {
       }
     }
   }
+
+  /* Resolve the camera against every mesh it touches, found with one query of the scene tree. */
+  inline void check_camera_collision(CameraObject *camera, AabbTree *scene) {
+    scene->query(aabb_from_box(camera->pos, camera->size), [&](int proxy) {
+      resolve_camera_collision(camera, scene->bounds(proxy));
+      return true;
+    });
+  }
+
+  inline void add_mesh_to_scene(AabbTree *scene, Mesh *mesh) {
+    mesh->proxy = scene->insert(mesh->bounds(), mesh);
+  }
+
+  inline void remove_mesh_from_scene(AabbTree *scene, Mesh *mesh) {
+    scene->remove(mesh->proxy);
+    mesh->proxy = AABB_NULL_NODE;
+  }
+
+  /* Call after `mesh` moved or changed size, the tree is only restructured when it left its fat box. */
+  inline void update_mesh_in_scene(AabbTree *scene, Mesh *mesh) {
+    const Aabb &last = scene->bounds(mesh->proxy);
+    Aabb now = mesh->bounds();
+    scene->move(mesh->proxy, now, (aabb_center(now) - aabb_center(last)));
+  }
+
+  /* Mesh the camera is looking at within `max_dist`, or nullptr.  Also nullptr when what it looks at is
+   * scenery without a `Mesh`, like `Stairs`. */
+  inline Mesh *pick_mesh(const CameraObject *camera, AabbTree *scene, float max_dist) {
+    /* The view looks from `pos` towards `pos - direction`. */
+    int proxy = scene->raycast(camera->pos, -camera->direction, max_dist);
+    return ((proxy == AABB_NULL_NODE) ? nullptr : (Mesh *)scene->user_data(proxy));
+  }
+
+  /* Mesh closest to `point`, or nullptr when the scene is empty. */
+  inline Mesh *nearest_mesh(const vec3 &point, AabbTree *scene) {
+    int proxy = scene->nearest(point);
+    return ((proxy == AABB_NULL_NODE) ? nullptr : (Mesh *)scene->user_data(proxy));
+  }
 }
 
 __NAMESPACE(MeshObject) {
@@ -318,26 +351,31 @@ __NAMESPACE(MeshObject) {
     };
   }
 
+  /* Steps of one shape, drawn as instances of a single cube. */
   class Stairs {
    private:
-    MVector<Mesh> data;
+    InstancedMesh steps;
 
    public:
-    Stairs(Uint shader, const vec3 &pos, Uint steps, const vec3 &step_size, const vec3 &color) {
-      for (Uint i = 0; i < steps; ++i) {
-        Mesh step(cube_vertices, cube_indices, shader);
-        step.pos.x = pos.x;
-        step.pos.y = (pos.y + (i * step_size.y));
-        step.pos.z = (pos.z + (i * step_size.z));
-        step._scale = step_size;
-        step.color = color;
-        data.push_back(step);
+    /* `shader` has to be built from instanced.vert. */
+    Stairs(Uint shader, const vec3 &pos, Uint count, const vec3 &step_size, const vec3 &color) : steps(cube_vertices, cube_indices, shader) {
+      for (Uint i = 0; i < count; ++i) {
+        steps.add({pos.x, (pos.y + (i * step_size.y)), (pos.z + (i * step_size.z))}, vec3(0.0f), step_size, color);
       }
     }
 
     void draw(GameObject *game) {
-      for (auto &step : data) {
-        step.draw(game);
+      steps.draw(game);
+    }
+
+    void submit(RenderQueue *queue) {
+      steps.submit(queue);
+    }
+
+    /* The steps are static scenery without a `Mesh`, so their proxies carry no user data. */
+    void add_to_scene(AabbTree *scene) {
+      for (Uint i = 0; i < steps.instances.size(); ++i) {
+        scene->insert(steps.bounds(i), nullptr);
       }
     }
   };
@@ -0,0 +1,187 @@
+#pragma once
+
+/* clang-format off */
+
+#include <stdio.h>
+
+#include "compute.h"
+
+/* Gpu particle system.  Particles live in the `ParticleBuffer` of shader.comp and never leave the gpu,
+ * they are spawned by PARTICLE_EMIT_OPERATION, integrated by PARTICLE_UPDATE_OPERATION, and drawn by
+ * particle.vert straight from the same buffer.  Dead slots are recycled through an atomic free list. */
+
+/* Must match the bindings of `ParticleBuffer` and `ParticleFreeBuffer` in shader.comp. */
+#define PARTICLE_BINDING      0
+#define PARTICLE_FREE_BINDING 20
+
+typedef struct {
+  vec3 pos;
+  /* Velocity of a new particle, each axis is randomized by up to `spread`. */
+  vec3 vel;
+  float spread;
+  /* Particles per second, and the max lifetime in seconds, each particle lives between half and all of it. */
+  float rate;
+  float life;
+  float size;
+  vec3 color;
+  /* Fraction of a particle left over from the last update. */
+  float pending;
+} ParticleEmitter;
+
+class ParticleSystem {
+ private:
+  Uint program = 0;
+  Uint render_program = 0;
+  Uint particle_ssbo = 0;
+  Uint free_ssbo = 0;
+  /* Empty, the quads are built from `gl_VertexID` and `gl_InstanceID` alone. */
+  Uint vao = 0;
+  Uint local_size = 1;
+  Uint seed = 0;
+  int dt_loc;
+  int operation_loc;
+  int emit_count_loc;
+  int emit_seed_loc;
+  int emit_pos_loc;
+  int emit_vel_loc;
+  int emit_spread_loc;
+  int emit_life_loc;
+  int emit_size_loc;
+  int emit_color_loc;
+
+  void bind(void) {
+    glUseProgram(program);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_BINDING, particle_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_FREE_BINDING, free_ssbo);
+  }
+
+  void dispatch(Uint operation, Uint items) {
+    glUniform1ui(operation_loc, operation);
+    glDispatchCompute(((items + local_size - 1) / local_size), 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+
+ public:
+  Uint capacity = 0;
+  MVector<ParticleEmitter> emitters;
+
+  ~ParticleSystem(void) {
+    if (!program) {
+      return;
+    }
+    glDeleteBuffers(1, &particle_ssbo);
+    glDeleteBuffers(1, &free_ssbo);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteProgram(program);
+    glDeleteProgram(render_program);
+  }
+
+  /* `program` is a compute program built from shader.comp, and `render_program` one built from particle.vert and particle.frag.
+   * Both have to be finished, see `finish_shader_programs()`. */
+  void init(Uint program, Uint render_program, Uint capacity) {
+    this->program        = program;
+    this->render_program = render_program;
+    this->capacity       = capacity;
+    int group_size[3];
+    glGetProgramiv(program, GL_COMPUTE_WORK_GROUP_SIZE, group_size);
+    local_size = (Uint)group_size[0];
+    glUseProgram(program);
+    dt_loc          = glGetUniformLocation(program, "delta_t");
+    operation_loc   = glGetUniformLocation(program, "operation");
+    emit_count_loc  = glGetUniformLocation(program, "emit_count");
+    emit_seed_loc   = glGetUniformLocation(program, "emit_seed");
+    emit_pos_loc    = glGetUniformLocation(program, "emit_pos");
+    emit_vel_loc    = glGetUniformLocation(program, "emit_vel");
+    emit_spread_loc = glGetUniformLocation(program, "emit_spread");
+    emit_life_loc   = glGetUniformLocation(program, "emit_life");
+    emit_size_loc   = glGetUniformLocation(program, "emit_size");
+    emit_color_loc  = glGetUniformLocation(program, "emit_color");
+    glUniform3f(glGetUniformLocation(program, "c_force"), 0.0f, -9.806f, 0.0f);
+    /* Every particle starts out dead, and every slot on the free list. */
+    glGenBuffers(1, &particle_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, particle_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (capacity * sizeof(Particle)), nullptr, GL_DYNAMIC_COPY);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, nullptr);
+    MVector<Uint> free_list;
+    free_list.resize(capacity + 1);
+    free_list[0] = capacity;
+    for (Uint i = 0; i < capacity; ++i) {
+      free_list[i + 1] = (capacity - 1 - i);
+    }
+    glGenBuffers(1, &free_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, free_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, ((capacity + 1) * sizeof(Uint)), free_list.data(), GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glGenVertexArrays(1, &vao);
+  }
+
+  void add_emitter(const ParticleEmitter &emitter) {
+    emitters.push_back(emitter);
+    emitters.back().pending = 0.0f;
+  }
+
+  /* Spawn `count` particles from `emitter` right away, particles past the capacity are dropped. */
+  void emit(const ParticleEmitter &emitter, Uint count) {
+    if (!count) {
+      return;
+    }
+    bind();
+    glUniform1ui(emit_count_loc, count);
+    glUniform1ui(emit_seed_loc, (seed += 0x9e3779b9u));
+    glUniform3f(emit_pos_loc, emitter.pos.x, emitter.pos.y, emitter.pos.z);
+    glUniform3f(emit_vel_loc, emitter.vel.x, emitter.vel.y, emitter.vel.z);
+    glUniform1f(emit_spread_loc, emitter.spread);
+    glUniform1f(emit_life_loc, emitter.life);
+    glUniform1f(emit_size_loc, emitter.size);
+    glUniform3f(emit_color_loc, emitter.color.x, emitter.color.y, emitter.color.z);
+    dispatch(PARTICLE_EMIT_OPERATION, count);
+  }
+
+  /* Emit what every emitter is due for `dt` seconds, then integrate every particle. */
+  void update(float dt) {
+    for (auto &emitter : emitters) {
+      emitter.pending += (emitter.rate * dt);
+      Uint count = (Uint)emitter.pending;
+      emitter.pending -= count;
+      emit(emitter, count);
+    }
+    bind();
+    glUniform1f(dt_loc, dt);
+    dispatch(PARTICLE_UPDATE_OPERATION, capacity);
+  }
+
+  /* The camera comes from the frame uniform buffer. */
+  void draw(void) {
+    glUseProgram(render_program);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_BINDING, particle_ssbo);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+    glBindVertexArray(vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, capacity);
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+  }
+
+  /* Fill the system with long lived particles, then time `steps` update passes on the gpu and print the
+   * throughput.  Returns particles per millisecond. */
+  double benchmark(Uint steps, FILE *out = stdout) {
+    ParticleEmitter fill = {{0.0f, 10.0f, 0.0f}, {0.0f, 5.0f, 0.0f}, 5.0f, 0.0f, 1e6f, 0.05f, {1.0f, 1.0f, 1.0f}, 0.0f};
+    emit(fill, capacity);
+    bind();
+    glUniform1f(dt_loc, FRAMETIME_S);
+    Uint query;
+    glGenQueries(1, &query);
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    for (Uint i = 0; i < steps; ++i) {
+      dispatch(PARTICLE_UPDATE_OPERATION, capacity);
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    GLuint64 ns;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+    glDeleteQueries(1, &query);
+    double ms = (ns / 1e6);
+    double rate = (((double)capacity * steps) / ms);
+    fprintf(out, "particles: %u x %u steps in %.3f ms, %.1f particles/ms\n", capacity, steps, ms, rate);
+    return rate;
+  }
+};
@@ -0,0 +1,277 @@
+#pragma once
+
+/* clang-format off */
+
+#include <stdio.h>
+#include <chrono>
+#include <GL/glew.h>
+#include <Mlib/Vector.h>
+
+/* Where each frame goes.  `PROFILE_SCOPE(name)` times the rest of the enclosing block on the cpu, and
+ * `PROFILE_GPU_SCOPE(name)` also times the gpu work issued in it with a `GL_TIME_ELAPSED` query.  The last
+ * `PROFILER_FRAMES` frames are kept in a ring, and can be written out as chrome trace json (load it in
+ * chrome://tracing or perfetto) or as csv.
+ *
+ * Nothing allocates or blocks while a frame runs, a scope is two clock reads and a store into the ring.
+ * Gpu queries are double buffered, the results of a frame are collected two frames later when they are
+ * done, so reading them never stalls the pipeline.  Build with `NO_PROFILER` defined and the scopes
+ * compile to nothing. */
+
+#ifndef NO_PROFILER
+  #define PROFILER_ENABLED 1
+#else
+  #define PROFILER_ENABLED 0
+#endif
+
+/* Frames kept, scopes per frame, and gpu scopes per frame. */
+#define PROFILER_FRAMES     256
+#define PROFILER_MAX_EVENTS 64
+#define PROFILER_MAX_GPU    16
+
+#define PROFILER_NONE 0xffffffffu
+
+typedef struct {
+  const char *name;
+  /* Nesting depth on the cpu, gpu scopes can not nest. */
+  Uint depth;
+  bool gpu;
+  /* Relative to the start of the frame.  Gpu events get the cpu time their work was issued at, and a
+   * duration below zero until their query is collected. */
+  double start_us;
+  double micros;
+} ProfileEvent;
+
+typedef struct {
+  Ulong number;
+  /* Since the profiler was enabled. */
+  double start_us;
+  double micros;
+  Uint count;
+  ProfileEvent events[PROFILER_MAX_EVENTS];
+} ProfileFrame;
+
+class Profiler {
+ private:
+  typedef std::chrono::high_resolution_clock clock;
+  typedef std::chrono::duration<double, std::micro> usec;
+
+  typedef struct {
+    Ulong frame;
+    Uint event;
+  } GpuPending;
+
+  MVector<ProfileFrame> frames;
+  Ulong frame_number = 0;
+  bool in_frame = false;
+  Uint depth = 0;
+  clock::time_point origin;
+  clock::time_point frame_start;
+  /* Two sets of queries, frame `n` uses set `n & 1` and collects what frame `n - 2` left in it. */
+  Uint queries[2][PROFILER_MAX_GPU];
+  GpuPending pending[2][PROFILER_MAX_GPU];
+  Uint pending_count[2] = {0, 0};
+  bool gpu_active = false;
+  bool gpu_ready = false;
+  /* Cost of one scope, measured when enabled, for the overhead estimate in `report()`. */
+  double scope_cost_us = 0.0;
+  Ulong total_scopes = 0;
+  double total_frame_us = 0.0;
+
+  double now_us(void) const {
+    return usec(clock::now() - origin).count();
+  }
+
+  ProfileFrame &current(void) {
+    return frames[frame_number % PROFILER_FRAMES];
+  }
+
+  /* Fill in the gpu durations of the frame that last used `set`, the ones not done yet are dropped. */
+  void collect(Uint set) {
+    for (Uint i = 0; i < pending_count[set]; ++i) {
+      const GpuPending &p = pending[set][i];
+      int available = 0;
+      glGetQueryObjectiv(queries[set][i], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available || (frame_number - p.frame) >= PROFILER_FRAMES) {
+        continue;
+      }
+      GLuint64 nanos = 0;
+      glGetQueryObjectui64v(queries[set][i], GL_QUERY_RESULT, &nanos);
+      frames[p.frame % PROFILER_FRAMES].events[p.event].micros = (nanos / 1000.0);
+    }
+    pending_count[set] = 0;
+  }
+
+ public:
+  bool enabled = false;
+
+  /* Start recording, `gpu` also creates the timer queries, so it needs a current context. */
+  void enable(bool gpu = true) {
+    frames.resize(PROFILER_FRAMES);
+    origin = clock::now();
+    if (gpu && !gpu_ready) {
+      glGenQueries((2 * PROFILER_MAX_GPU), &queries[0][0]);
+      gpu_ready = true;
+    }
+    /* What a scope costs, two clock reads and the bookkeeping around them. */
+    const Uint samples = 1000;
+    double start = now_us();
+    for (Uint i = 0; i < samples; ++i) {
+      volatile double t = now_us();
+      (void)t;
+    }
+    scope_cost_us = (((now_us() - start) / samples) * 2.0);
+    enabled = true;
+  }
+
+  void release(void) {
+    if (gpu_ready) {
+      glDeleteQueries((2 * PROFILER_MAX_GPU), &queries[0][0]);
+      gpu_ready = false;
+    }
+    enabled = false;
+  }
+
+  void begin_frame(void) {
+    if (!enabled) {
+      return;
+    }
+    if (gpu_ready) {
+      collect(frame_number & 1);
+    }
+    frame_start = clock::now();
+    ProfileFrame &f = current();
+    f.number   = frame_number;
+    f.start_us = usec(frame_start - origin).count();
+    f.micros   = 0.0;
+    f.count    = 0;
+    depth    = 0;
+    in_frame = true;
+  }
+
+  void end_frame(void) {
+    if (!in_frame) {
+      return;
+    }
+    ProfileFrame &f = current();
+    f.micros = usec(clock::now() - frame_start).count();
+    total_frame_us += f.micros;
+    total_scopes   += f.count;
+    in_frame = false;
+    ++frame_number;
+  }
+
+  Uint begin(const char *name, bool gpu = false) {
+    if (!in_frame || current().count == PROFILER_MAX_EVENTS) {
+      return PROFILER_NONE;
+    }
+    ProfileFrame &f = current();
+    Uint set = (frame_number & 1);
+    /* Time elapsed queries can not overlap, a gpu scope inside another one is timed on the cpu only. */
+    gpu = (gpu && gpu_ready && !gpu_active && pending_count[set] < PROFILER_MAX_GPU);
+    Uint index = f.count++;
+    f.events[index] = {name, depth++, gpu, usec(clock::now() - frame_start).count(), (gpu ? -1.0 : 0.0)};
+    if (gpu) {
+      pending[set][pending_count[set]] = {frame_number, index};
+      glBeginQuery(GL_TIME_ELAPSED, queries[set][pending_count[set]++]);
+      gpu_active = true;
+    }
+    return index;
+  }
+
+  void end(Uint index) {
+    if (index == PROFILER_NONE || !in_frame) {
+      return;
+    }
+    ProfileEvent &e = current().events[index];
+    --depth;
+    if (e.gpu) {
+      glEndQuery(GL_TIME_ELAPSED);
+      gpu_active = false;
+      return;
+    }
+    e.micros = (usec(clock::now() - frame_start).count() - e.start_us);
+  }
+
+  /* Visit every event of every kept frame, oldest first, `fn(frame, event)`.  Gpu events that were never
+   * collected are left out. */
+  template <typename F>
+  void for_each(F &&fn) const {
+    Ulong first = ((frame_number > PROFILER_FRAMES) ? (frame_number - PROFILER_FRAMES) : 0);
+    for (Ulong n = first; n < frame_number; ++n) {
+      const ProfileFrame &f = frames[n % PROFILER_FRAMES];
+      for (Uint i = 0; i < f.count; ++i) {
+        if (f.events[i].micros >= 0.0) {
+          fn(f, f.events[i]);
+        }
+      }
+    }
+  }
+
+  /* Chrome trace event format, cpu scopes on thread 0 and gpu scopes on thread 1. */
+  bool write_trace(const char *path) const {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+      return false;
+    }
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for_each([&](const ProfileFrame &f, const ProfileEvent &e) {
+      fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%lu}}",
+        (first ? "" : ",\n"), e.name, (e.gpu ? "gpu" : "cpu"), (f.start_us + e.start_us), e.micros, (e.gpu ? 1 : 0), f.number);
+      first = false;
+    });
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return (fclose(file) == 0);
+  }
+
+  bool write_csv(const char *path) const {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+      return false;
+    }
+    fprintf(file, "frame,scope,timeline,depth,start_us,duration_us\n");
+    for_each([&](const ProfileFrame &f, const ProfileEvent &e) {
+      fprintf(file, "%lu,%s,%s,%u,%.3f,%.3f\n", f.number, e.name, (e.gpu ? "gpu" : "cpu"), e.depth, e.start_us, e.micros);
+    });
+    return (fclose(file) == 0);
+  }
+
+  void report(FILE *out = stdout) const {
+    if (!frame_number) {
+      return;
+    }
+    double overhead = ((total_frame_us > 0.0) ? ((total_scopes * scope_cost_us) / total_frame_us * 100.0) : 0.0);
+    fprintf(out, "profiler: %lu frames, %.1f scopes per frame, about %.3f%% of the frame time spent profiling\n",
+      frame_number, ((double)total_scopes / frame_number), overhead);
+  }
+};
+
+inline Profiler &profiler(void) {
+  static Profiler p;
+  return p;
+}
+
+#if PROFILER_ENABLED
+class ProfileScope {
+ private:
+  Uint index;
+
+ public:
+  ProfileScope(const char *name, bool gpu = false) : index(profiler().enabled ? profiler().begin(name, gpu) : PROFILER_NONE) {}
+  ~ProfileScope(void) {
+    profiler().end(index);
+  }
+};
+
+  #define PROFILE_CONCAT_(a, b) a##b
+  #define PROFILE_CONCAT(a, b)  PROFILE_CONCAT_(a, b)
+  #define PROFILE_SCOPE(name)     ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+  #define PROFILE_GPU_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name, true)
+  #define PROFILE_BEGIN_FRAME()   profiler().begin_frame()
+  #define PROFILE_END_FRAME()     profiler().end_frame()
+#else
+  #define PROFILE_SCOPE(name)
+  #define PROFILE_GPU_SCOPE(name)
+  #define PROFILE_BEGIN_FRAME()
+  #define PROFILE_END_FRAME()
+#endif
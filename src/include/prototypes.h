@@ -3,12 +3,22 @@
 /* clang-format off */
 
 #include "mesh.h"
+#include "broadphase.h"
+#include "indirect.h"
+#include "frustum_cull.h"
+#include "shader_cache.h"
+#include "recording.h"
 #include "def.h"
 #include "utils.h"
 
 /* shader.cpp */
 Uint create_shader_program(const MVector<Pair<const char *, Uint>> &parts, const MVector<const char *> &includes);
-Uint create_comp_shader_program(const char *path);
+bool body_soa_supported(void);
+Uint create_comp_shader_program(const char *path, Uint local_size = 64, bool soa = false);
+Uint create_body_shader_program(const MVector<Pair<const char *, Uint>> &parts, bool soa);
+Uint build_shader_program(const std::vector<ShaderStage> &stages, const MVector<const char *> &includes);
+ShaderStage preprocess_shader(const char *path, Uint type, const MVector<const char *> &includes, const std::string &prelude);
+void finish_shader_programs(void);
 
 /* utils.cpp */
 void set_correct_view_direction(GameObject *game);
@@ -0,0 +1,623 @@
+#pragma once
+
+/* clang-format off */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "def.h"
+
+/* Recording of a run, to replay it later without simulating it again.  Every frame stores the body state,
+ * position, velocity, size and flags of each `ComputeData`, and the camera.  Values are quantized to
+ * `1 / RECORDING_QUANT` units and stored as the difference to the frame before, zigzag and varint coded,
+ * so bodies at rest take one byte per field.  Frames go into chunks of `key_interval` frames, the first
+ * of each chunk is stored against zero instead, so any chunk decodes on its own.  Chunks are packed with
+ * a small lz77 coder.  All of that is done by a thread of its own, the thread recording only copies the
+ * frame.  The file ends with the index of the chunks, which is what seeking goes through.
+ *
+ * File layout:  RecordingHeader, chunks (RecordingChunk and its packed bytes), the index (one
+ * RecordingIndexEntry per chunk), RecordingFooter. */
+
+#define RECORDING_MAGIC   0x52434552u
+#define RECORDING_VERSION 1
+/* Quantization steps per unit, about a quarter of a millimeter for positions. */
+#define RECORDING_QUANT   4096.0f
+#define RECORDING_KEY_INTERVAL 64
+/* Frames `record()` may get ahead of the writer thread. */
+#define RECORDING_QUEUE_FRAMES 128
+/* How often the writer thread looks for queued frames, so `record()` only has to wake it when the queue is full. */
+#define RECORDING_POLL_MS      16
+
+/* Quantized fields per body, position, velocity and size, then the two flag words. */
+#define RECORDING_BODY_FIELDS 9
+#define RECORDING_BODY_FLAGS  2
+/* Position, yaw and pitch. */
+#define RECORDING_CAMERA_FIELDS 5
+/* Most bodies a recording can hold, so a damaged header cannot make a replay allocate gigabytes. */
+#define RECORDING_MAX_BODIES (1u << 20)
+
+typedef struct {
+  vec3 pos;
+  float yaw;
+  float pitch;
+} RecordedCamera;
+
+typedef struct {
+  Uint magic;
+  Uint version;
+  Uint body_count;
+  Uint key_interval;
+  float quant;
+  Uint reserved;
+} RecordingHeader;
+
+typedef struct {
+  Uint first_frame;
+  Uint frame_count;
+  Uint raw_size;
+  Uint packed_size;
+} RecordingChunk;
+
+typedef struct {
+  Ulong offset;
+  Uint first_frame;
+  Uint frame_count;
+} RecordingIndexEntry;
+
+typedef struct {
+  Ulong index_offset;
+  Uint chunk_count;
+  Uint frame_count;
+  Uint magic;
+  Uint reserved;
+} RecordingFooter;
+
+typedef struct {
+  Ulong frames;
+  Ulong raw_bytes;
+  Ulong packed_bytes;
+  /* Times `record()` had to wait for the writer thread to catch up. */
+  Ulong waits;
+  /* Spent coding, packing and writing on the writer thread.  `record()` itself is not timed, that would
+   * cost as much as the copy it makes, see the "record" profile scope in main.cpp instead. */
+  double code_ms;
+} RecordingStats;
+
+__INLINE_NAMESPACE(RecordingCodec) {
+  inline void put_varint(std::vector<Uchar> *out, Ulong v) {
+    while (v >= 0x80) {
+      out->push_back((Uchar)(v | 0x80));
+      v >>= 7;
+    }
+    out->push_back((Uchar)v);
+  }
+
+  /* Into memory with room for it, at most 5 bytes for 32 bits.  Returns the end of what was written. */
+  inline Uchar *put_varint(Uchar *out, Uint v) {
+    while (v >= 0x80) {
+      *out++ = (Uchar)(v | 0x80);
+      v >>= 7;
+    }
+    *out++ = (Uchar)v;
+    return out;
+  }
+
+  /* Returns false when `p` runs past `end`. */
+  inline bool get_varint(const Uchar **p, const Uchar *end, Ulong *v) {
+    Ulong result = 0;
+    for (Uint shift = 0; shift < 64; shift += 7) {
+      if (*p == end) {
+        return false;
+      }
+      Uchar byte = *(*p)++;
+      result |= ((Ulong)(byte & 0x7f) << shift);
+      if (!(byte & 0x80)) {
+        *v = result;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  inline Uint zigzag(int v) {
+    return (((Uint)v << 1) ^ (Uint)(v >> 31));
+  }
+
+  inline int unzigzag(Uint v) {
+    return (int)((v >> 1) ^ (0u - (v & 1)));
+  }
+
+  /* Rounded half away from zero, without a call to `lrintf()`. */
+  inline int quantize(float v) {
+    v *= RECORDING_QUANT;
+    return (int)(v + ((v < 0.0f) ? -0.5f : 0.5f));
+  }
+
+  /* Lz77 with a 64k window.  A list of sequences, `literal count, literals, match length - 3, offset`
+   * with the numbers as varints.  The last sequence has only its literals, and a match length of zero. */
+  inline void lz_pack(const Uchar *src, Uint size, std::vector<Uchar> *out) {
+    const Uint hash_bits = 14;
+    std::vector<int> table((1 << hash_bits), -1);
+    auto hash = [&](Uint i) {
+      Uint v;
+      memcpy(&v, (src + i), 4);
+      return ((v * 2654435761u) >> (32 - hash_bits));
+    };
+    Uint anchor = 0;
+    Uint i = 0;
+    while ((i + 4) <= size) {
+      Uint h = hash(i);
+      int candidate = table[h];
+      table[h] = (int)i;
+      if (candidate < 0 || (i - candidate) > 0xffff || memcmp((src + candidate), (src + i), 4) != 0) {
+        ++i;
+        continue;
+      }
+      Uint length = 4;
+      while ((i + length) < size && src[candidate + length] == src[i + length]) {
+        ++length;
+      }
+      put_varint(out, (i - anchor));
+      out->insert(out->end(), (src + anchor), (src + i));
+      put_varint(out, (length - 3));
+      put_varint(out, (i - candidate));
+      i += length;
+      anchor = i;
+    }
+    put_varint(out, (size - anchor));
+    out->insert(out->end(), (src + anchor), (src + size));
+    put_varint(out, 0);
+  }
+
+  /* Unpack into `out`, which has to be `raw_size` bytes.  Returns false on anything malformed. */
+  inline bool lz_unpack(const Uchar *src, Uint size, Uchar *out, Uint raw_size) {
+    const Uchar *p   = src;
+    const Uchar *end = (src + size);
+    Uint o = 0;
+    while (true) {
+      Ulong literals;
+      if (!get_varint(&p, end, &literals) || literals > (Ulong)(end - p) || literals > (raw_size - o)) {
+        return false;
+      }
+      memcpy((out + o), p, literals);
+      p += literals;
+      o += literals;
+      Ulong match;
+      if (!get_varint(&p, end, &match)) {
+        return false;
+      }
+      if (!match) {
+        return (o == raw_size);
+      }
+      Ulong offset;
+      Ulong length = (match + 3);
+      if (!get_varint(&p, end, &offset) || !offset || offset > o || length > (raw_size - o)) {
+        return false;
+      }
+      /* Byte by byte, a match may overlap what it copies. */
+      for (Ulong k = 0; k < length; ++k, ++o) {
+        out[o] = out[o - offset];
+      }
+    }
+  }
+
+  /* Quantized state of one frame, the reference the next one is coded against. */
+  typedef struct {
+    std::vector<int> fields;
+    std::vector<Uint> flags;
+    int camera[RECORDING_CAMERA_FIELDS];
+  } RecordingState;
+
+  inline void reset_state(RecordingState *s, Uint body_count) {
+    s->fields.assign((body_count * RECORDING_BODY_FIELDS), 0);
+    s->flags.assign((body_count * RECORDING_BODY_FLAGS), 0);
+    memset(s->camera, 0, sizeof(s->camera));
+  }
+}
+
+/* Writes a recording, `record()` once per frame.  The frame is only copied there, coding, packing and
+ * writing it is all done by the writer thread. */
+class Recorder {
+ private:
+  typedef struct {
+    std::vector<ComputeData> bodies;
+    RecordedCamera camera;
+  } PendingFrame;
+
+  FILE *file = nullptr;
+  Uint body_count = 0;
+  Uint key_interval = RECORDING_KEY_INTERVAL;
+  Uint frame = 0;
+  /* Only touched by the writer thread once it runs. */
+  RecordingState state;
+  RecordingChunk chunk;
+  std::vector<Uchar> raw;
+  std::vector<Uchar> packed;
+  std::vector<RecordingIndexEntry> index;
+  Ulong offset = 0;
+  bool failed = false;
+  /* Frames waiting for the writer thread, and copies it is done with, to be filled again. */
+  std::deque<PendingFrame> queue;
+  std::vector<std::vector<ComputeData>> spare;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  std::condition_variable room_cv;
+  bool stopping = false;
+  std::thread thread;
+
+  void write(const void *data, Ulong size) {
+    if (!failed && fwrite(data, 1, size, file) != size) {
+      failed = true;
+    }
+    offset += size;
+  }
+
+  /* Append `f` to the current chunk, against the frame before or against zero when it starts a chunk. */
+  void code(const PendingFrame &f) {
+    if (!chunk.frame_count) {
+      reset_state(&state, body_count);
+    }
+    /* Room for the worst case up front, so coding is plain stores. */
+    Ulong used = raw.size();
+    raw.resize(used + ((RECORDING_CAMERA_FIELDS + (body_count * (RECORDING_BODY_FIELDS + RECORDING_BODY_FLAGS))) * 5));
+    Uchar *out = (raw.data() + used);
+    int cam[RECORDING_CAMERA_FIELDS] = {
+      quantize(f.camera.pos.x), quantize(f.camera.pos.y), quantize(f.camera.pos.z), quantize(f.camera.yaw), quantize(f.camera.pitch)
+    };
+    for (Uint c = 0; c < RECORDING_CAMERA_FIELDS; ++c) {
+      out = put_varint(out, zigzag(cam[c] - state.camera[c]));
+      state.camera[c] = cam[c];
+    }
+    /* Field by field rather than body by body, so the runs of unchanged values are long. */
+    for (Uint field = 0; field < RECORDING_BODY_FIELDS; ++field) {
+      int *prev = &state.fields[field * body_count];
+      for (Uint i = 0; i < body_count; ++i) {
+        const ComputeData &cd = f.bodies[i];
+        const vec3 &v = ((field < 3) ? cd.pos : (field < 6) ? cd.vel : cd.size);
+        int q = quantize(v[field % 3]);
+        out = put_varint(out, zigzag(q - prev[i]));
+        prev[i] = q;
+      }
+    }
+    for (Uint field = 0; field < RECORDING_BODY_FLAGS; ++field) {
+      Uint *prev = &state.flags[field * body_count];
+      for (Uint i = 0; i < body_count; ++i) {
+        Uint flags = (Uint)f.bodies[i].flags[field];
+        out = put_varint(out, (flags ^ prev[i]));
+        prev[i] = flags;
+      }
+    }
+    raw.resize(out - raw.data());
+    if (++chunk.frame_count == key_interval) {
+      write_chunk();
+    }
+  }
+
+  void write_chunk(void) {
+    if (!chunk.frame_count) {
+      return;
+    }
+    packed.clear();
+    lz_pack(raw.data(), raw.size(), &packed);
+    chunk.raw_size    = raw.size();
+    chunk.packed_size = packed.size();
+    index.push_back({offset, chunk.first_frame, chunk.frame_count});
+    write(&chunk, sizeof(chunk));
+    write(packed.data(), packed.size());
+    stats.raw_bytes    += raw.size();
+    stats.packed_bytes += (sizeof(chunk) + packed.size());
+    chunk = {(chunk.first_frame + chunk.frame_count), 0, 0, 0};
+    raw.clear();
+  }
+
+  void run(void) {
+    /* Below the threads that simulate and draw, so on a busy machine recording only takes idle time, the
+     * sleep at the end of each frame for one. */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (true) {
+      queue_cv.wait_for(lock, std::chrono::milliseconds(RECORDING_POLL_MS), [this] { return (stopping || queue.size() >= RECORDING_QUEUE_FRAMES); });
+      while (!queue.empty()) {
+        PendingFrame f = std::move(queue.front());
+        queue.pop_front();
+        room_cv.notify_one();
+        lock.unlock();
+        auto start = std::chrono::high_resolution_clock::now();
+        code(f);
+        stats.code_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        lock.lock();
+        spare.push_back(std::move(f.bodies));
+      }
+      if (stopping) {
+        break;
+      }
+    }
+    lock.unlock();
+    write_chunk();
+  }
+
+ public:
+  RecordingStats stats = {};
+
+  ~Recorder(void) {
+    stop();
+  }
+
+  bool is_recording(void) const {
+    return (file != nullptr);
+  }
+
+  bool start(const char *path, Uint bodies, Uint interval = RECORDING_KEY_INTERVAL) {
+    if (bodies > RECORDING_MAX_BODIES) {
+      return false;
+    }
+    file = fopen(path, "wb");
+    if (!file) {
+      return false;
+    }
+    body_count   = bodies;
+    key_interval = (interval ? interval : 1);
+    frame  = 0;
+    offset = 0;
+    stats  = {};
+    failed = false;
+    chunk  = {0, 0, 0, 0};
+    raw.clear();
+    index.clear();
+    RecordingHeader header = {RECORDING_MAGIC, RECORDING_VERSION, body_count, key_interval, RECORDING_QUANT, 0};
+    write(&header, sizeof(header));
+    stopping = false;
+    thread = std::thread([this] { run(); });
+    return true;
+  }
+
+  /* Add a frame.  `bodies` has to hold at least the body count the recording was started with.  Only
+   * waits when the writer thread is `RECORDING_QUEUE_FRAMES` frames behind. */
+  void record(const MVector<ComputeData> &bodies, const RecordedCamera &camera) {
+    if (!file || bodies.size() < body_count) {
+      return;
+    }
+    {
+      /* One lock round trip per frame, the copy is short enough to make under it. */
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      if (queue.size() >= RECORDING_QUEUE_FRAMES) {
+        ++stats.waits;
+        queue_cv.notify_one();
+        room_cv.wait(lock, [this] { return (queue.size() < RECORDING_QUEUE_FRAMES); });
+      }
+      queue.push_back({{}, camera});
+      std::vector<ComputeData> &copy = queue.back().bodies;
+      if (!spare.empty()) {
+        copy = std::move(spare.back());
+        spare.pop_back();
+      }
+      copy.resize(body_count);
+      memcpy(copy.data(), bodies.data(), (body_count * sizeof(ComputeData)));
+    }
+    ++frame;
+    ++stats.frames;
+  }
+
+  /* Write out what is left, the index and the footer, and close the file.  Returns false when any write
+   * failed. */
+  bool stop(void) {
+    if (!file) {
+      return true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      stopping = true;
+    }
+    queue_cv.notify_one();
+    thread.join();
+    RecordingFooter footer = {offset, (Uint)index.size(), frame, RECORDING_MAGIC, 0};
+    write(index.data(), (index.size() * sizeof(RecordingIndexEntry)));
+    write(&footer, sizeof(footer));
+    bool ok = ((fclose(file) == 0) && !failed);
+    file = nullptr;
+    queue.clear();
+    spare.clear();
+    return ok;
+  }
+
+  void report(FILE *out = stdout) const {
+    double frames = (stats.frames ? (double)stats.frames : 1.0);
+    fprintf(out, "recording: %lu frames, %.2f MB coded into %.2f MB, %lu waits for the writer thread, %.3f ms per frame coding on it\n",
+      stats.frames, (stats.raw_bytes / 1e6), (stats.packed_bytes / 1e6), stats.waits, (stats.code_ms / frames));
+  }
+};
+
+/* Plays a recording back from a memory map of the file, decoding only the frames asked for.  Going
+ * forward one frame at a time decodes one frame, any other jump decodes the chunk it lands in up to it. */
+class Replay {
+ private:
+  int fd = -1;
+  const Uchar *map = nullptr;
+  Ulong map_size = 0;
+  const RecordingHeader *header = nullptr;
+  /* Copied out of the map, entries there are not aligned. */
+  std::vector<RecordingIndexEntry> index;
+  /* Chunk unpacked last, and how far into it decoding got. */
+  int chunk = -1;
+  std::vector<Uchar> raw;
+  Uint cursor = 0;
+  int decoded = -1;
+  RecordingState state;
+
+  /* Chunks lie between the header and the index, `open()` checks every one of them. */
+  Ulong chunks_end = 0;
+
+  /* Whether chunk `c` lies inside the chunk area, holds the frames the header and footer say it does, and
+   * has a raw size its frames can code to, at least one and at most five bytes per value. */
+  bool valid_chunk(Uint c, Uint frames) const {
+    const RecordingIndexEntry &e = index[c];
+    if (e.offset < sizeof(RecordingHeader) || e.offset > (chunks_end - sizeof(RecordingChunk))) {
+      return false;
+    }
+    RecordingChunk info;
+    memcpy(&info, (map + e.offset), sizeof(info));
+    Uint first = (c * header->key_interval);
+    Uint count = ((frames - first) < header->key_interval ? (frames - first) : header->key_interval);
+    Ulong values = ((Ulong)count * (RECORDING_CAMERA_FIELDS + ((Ulong)header->body_count * (RECORDING_BODY_FIELDS + RECORDING_BODY_FLAGS))));
+    return (e.first_frame == first && e.frame_count == count && info.first_frame == first && info.frame_count == count &&
+            info.packed_size <= (chunks_end - e.offset - sizeof(info)) && info.raw_size >= values && info.raw_size <= (values * 5));
+  }
+
+  bool unpack_chunk(Uint c) {
+    const RecordingIndexEntry &e = index[c];
+    RecordingChunk info;
+    memcpy(&info, (map + e.offset), sizeof(info));
+    raw.resize(info.raw_size);
+    if (!lz_unpack((map + e.offset + sizeof(info)), info.packed_size, raw.data(), info.raw_size)) {
+      return false;
+    }
+    chunk   = (int)c;
+    cursor  = 0;
+    decoded = ((int)e.first_frame - 1);
+    reset_state(&state, header->body_count);
+    return true;
+  }
+
+  bool decode_next(void) {
+    const Uchar *p   = (raw.data() + cursor);
+    const Uchar *end = (raw.data() + raw.size());
+    Ulong v;
+    for (Uint c = 0; c < RECORDING_CAMERA_FIELDS; ++c) {
+      if (!get_varint(&p, end, &v)) {
+        return false;
+      }
+      state.camera[c] += unzigzag((Uint)v);
+    }
+    for (int &field : state.fields) {
+      if (!get_varint(&p, end, &v)) {
+        return false;
+      }
+      field += unzigzag((Uint)v);
+    }
+    for (Uint &flags : state.flags) {
+      if (!get_varint(&p, end, &v)) {
+        return false;
+      }
+      flags ^= (Uint)v;
+    }
+    cursor = (p - raw.data());
+    ++decoded;
+    return true;
+  }
+
+ public:
+  ~Replay(void) {
+    close();
+  }
+
+  bool open(const char *path) {
+    close();
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (Ulong)st.st_size < (sizeof(RecordingHeader) + sizeof(RecordingFooter))) {
+      close();
+      return false;
+    }
+    map_size = st.st_size;
+    void *m = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+      close();
+      return false;
+    }
+    map = (const Uchar *)m;
+    header = (const RecordingHeader *)map;
+    RecordingFooter footer;
+    memcpy(&footer, (map + map_size - sizeof(footer)), sizeof(footer));
+    /* Every size and offset below comes from the file, so they are checked in an order that cannot wrap. */
+    if (header->magic != RECORDING_MAGIC || header->version != RECORDING_VERSION || header->quant != RECORDING_QUANT ||
+        !header->key_interval || header->body_count > RECORDING_MAX_BODIES || footer.magic != RECORDING_MAGIC ||
+        footer.index_offset < sizeof(RecordingHeader) || footer.index_offset > (map_size - sizeof(footer)) ||
+        (map_size - sizeof(footer) - footer.index_offset) != ((Ulong)footer.chunk_count * sizeof(RecordingIndexEntry)) ||
+        footer.chunk_count != (((Ulong)footer.frame_count + header->key_interval - 1) / header->key_interval)) {
+      close();
+      return false;
+    }
+    chunks_end = footer.index_offset;
+    index.resize(footer.chunk_count);
+    memcpy(index.data(), (map + footer.index_offset), (index.size() * sizeof(RecordingIndexEntry)));
+    for (Uint c = 0; c < index.size(); ++c) {
+      if (!valid_chunk(c, footer.frame_count)) {
+        close();
+        return false;
+      }
+    }
+    frame_count = footer.frame_count;
+    body_count  = header->body_count;
+    chunk   = -1;
+    decoded = -1;
+    return true;
+  }
+
+  void close(void) {
+    if (map) {
+      munmap((void *)map, map_size);
+      map = nullptr;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    frame_count = 0;
+    body_count  = 0;
+  }
+
+  Uint frame_count = 0;
+  Uint body_count = 0;
+
+  /* Decode frame `n` into `bodies` and `camera`, returns false past the end or when the file is damaged. */
+  bool frame(Uint n, MVector<ComputeData> *bodies, RecordedCamera *camera) {
+    if (n >= frame_count) {
+      return false;
+    }
+    /* Chunks all hold `key_interval` frames, except for the last. */
+    Uint c = (n / header->key_interval);
+    if (c >= index.size()) {
+      return false;
+    }
+    if ((int)c != chunk || (int)n < decoded) {
+      if (!unpack_chunk(c)) {
+        return false;
+      }
+    }
+    while (decoded < (int)n) {
+      if (!decode_next()) {
+        return false;
+      }
+    }
+    bodies->resize(body_count);
+    for (Uint i = 0; i < body_count; ++i) {
+      ComputeData &cd = (*bodies)[i];
+      for (Uint f = 0; f < RECORDING_BODY_FIELDS; ++f) {
+        vec3 &v = ((f < 3) ? cd.pos : (f < 6) ? cd.vel : cd.size);
+        v[f % 3] = (state.fields[(f * body_count) + i] / RECORDING_QUANT);
+      }
+      cd.accel = vec3(0.0f);
+      cd.flags[0] = state.flags[i];
+      cd.flags[1] = state.flags[body_count + i];
+    }
+    camera->pos   = vec3((state.camera[0] / RECORDING_QUANT), (state.camera[1] / RECORDING_QUANT), (state.camera[2] / RECORDING_QUANT));
+    camera->yaw   = (state.camera[3] / RECORDING_QUANT);
+    camera->pitch = (state.camera[4] / RECORDING_QUANT);
+    return true;
+  }
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+/* clang-format off */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+
+#include "def.h"
+#include "geometry.h"
+
+/* Draws are not issued as they are made, they are collected as packets for the whole frame, sorted by
+ * program, vao and material, and then issued in that order.  Consecutive packets that share state only
+ * change what differs, so a frame with one program and the shared geometry vaos of geometry.h costs one
+ * `glUseProgram()` and one `glBindVertexArray()` per vao instead of one per mesh. */
+
+/* Programs, and vaos, one queue can tell apart, each gets 8 bits of the sort key. */
+#define RENDER_QUEUE_SLOTS 256
+
+typedef struct {
+  /* Sort key, see `RenderQueue::make_key()`. */
+  Ulong key;
+  Uint program;
+  Uint vao;
+  GeometryHandle geometry;
+  /* Per object data for plain draws, the normal matrix as three columns. */
+  mat4 model;
+  vec3 normal[3];
+  vec3 color;
+  /* Instanced draws, `instances` is zero for plain draws. */
+  Uint instance_buffer;
+  Uint instances;
+} DrawPacket;
+
+typedef struct {
+  Ulong draws;
+  Ulong program_switches;
+  Ulong vao_binds;
+  Ulong frames;
+} RenderQueueStats;
+
+class RenderQueue {
+ private:
+  typedef struct {
+    Ulong key;
+    Uint index;
+  } SortItem;
+
+  /* Per object uniforms of a program, looked up the first time it is seen. */
+  typedef struct {
+    Uint program;
+    int model_loc;
+    int normal_matrix_loc;
+    int color_loc;
+  } ProgramSlot;
+
+  MVector<DrawPacket> packets;
+  MVector<SortItem> order;
+  MVector<SortItem> scratch;
+  /* Programs and vaos get small ids in the order they are first seen, so they fit in the key. */
+  MVector<ProgramSlot> programs;
+  MVector<Uint> vaos;
+
+  Uint program_slot(Uint program) {
+    for (Uint i = 0; i < programs.size(); ++i) {
+      if (programs[i].program == program) {
+        return i;
+      }
+    }
+    assert(programs.size() < RENDER_QUEUE_SLOTS && "RenderQueue: too many programs for the sort key");
+    programs.push_back({program, glGetUniformLocation(program, "model"), glGetUniformLocation(program, "normal_matrix"), glGetUniformLocation(program, "input_color")});
+    return (programs.size() - 1);
+  }
+
+  Uint vao_slot(Uint vao) {
+    for (Uint i = 0; i < vaos.size(); ++i) {
+      if (vaos[i] == vao) {
+        return i;
+      }
+    }
+    assert(vaos.size() < RENDER_QUEUE_SLOTS && "RenderQueue: too many vaos for the sort key");
+    vaos.push_back(vao);
+    return (vaos.size() - 1);
+  }
+
+  /* Most significant first, program, vao, material, then where the geometry starts so draws of one
+   * shape end up next to each other. */
+  Ulong make_key(Uint program, Uint vao, Uint material, const GeometryHandle &geometry) {
+    return (((Ulong)(program_slot(program) & 0xff) << 56) | ((Ulong)(vao_slot(vao) & 0xff) << 48) |
+            ((Ulong)(material & 0xffff) << 32) | (Ulong)geometry.first_index);
+  }
+
+  /* Lsd radix sort of `order` by key, one byte per pass.  Passes where every key has the same byte are
+   * skipped, which with few programs and vaos is most of the high ones.  Stable, so packets with equal
+   * keys keep the order they were submitted in. */
+  void sort(void) {
+    Uint n = packets.size();
+    order.resize(n);
+    scratch.resize(n);
+    for (Uint i = 0; i < n; ++i) {
+      order[i] = {packets[i].key, i};
+    }
+    SortItem *src = order.data();
+    SortItem *dst = scratch.data();
+    for (Uint shift = 0; shift < 64; shift += 8) {
+      Uint count[256] = {};
+      for (Uint i = 0; i < n; ++i) {
+        ++count[(src[i].key >> shift) & 0xff];
+      }
+      if (count[(src[0].key >> shift) & 0xff] == n) {
+        continue;
+      }
+      Uint offset = 0;
+      for (Uint d = 0; d < 256; ++d) {
+        Uint c = count[d];
+        count[d] = offset;
+        offset += c;
+      }
+      for (Uint i = 0; i < n; ++i) {
+        dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+      }
+      std::swap(src, dst);
+    }
+    if (src != order.data()) {
+      memcpy(order.data(), src, (n * sizeof(SortItem)));
+    }
+  }
+
+ public:
+  /* Totals since the queue was created. */
+  RenderQueueStats stats = {};
+
+  /* Queue a plain draw of `geometry` with per object `model`, its normal matrix `normal` and `color`.
+   * `material` groups draws that share the same material state, draws without one use 0. */
+  void submit(Uint program, const GeometryHandle &geometry, const mat4 &model, const vec3 *normal, const vec3 &color, Uint material = 0) {
+    Uint vao = geometry_arena().vao();
+    packets.push_back({make_key(program, vao, material, geometry), program, vao, geometry, model, {normal[0], normal[1], normal[2]}, color, 0, 0});
+  }
+
+  /* Queue `instances` instances of `geometry`, with the per instance data in `instance_buffer`. */
+  void submit_instanced(Uint program, const GeometryHandle &geometry, Uint instance_buffer, Uint instances, Uint material = 0) {
+    if (!instances) {
+      return;
+    }
+    Uint vao = geometry_arena().vao(GEOMETRY_VAO_INSTANCED);
+    packets.push_back({make_key(program, vao, material, geometry), program, vao, geometry, mat4(1.0f), {}, vec3(0.0f), instance_buffer, instances});
+  }
+
+  /* Sort everything submitted since the last flush, issue it, and empty the queue. */
+  void flush(void) {
+    if (packets.empty()) {
+      return;
+    }
+    sort();
+    Uint program = 0;
+    Uint vao     = 0;
+    const ProgramSlot *slot = nullptr;
+    for (const auto &item : order) {
+      const DrawPacket &p = packets[item.index];
+      if (p.program != program) {
+        glUseProgram(p.program);
+        program = p.program;
+        slot = &programs[program_slot(p.program)];
+        ++stats.program_switches;
+      }
+      if (p.vao != vao) {
+        glBindVertexArray(p.vao);
+        vao = p.vao;
+        ++stats.vao_binds;
+      }
+      if (p.instances) {
+        glBindVertexBuffer(GEOMETRY_INSTANCE_BINDING, p.instance_buffer, 0, sizeof(InstanceData));
+        geometry_arena().draw_instanced(p.geometry, p.instances);
+      }
+      else {
+        glUniformMatrix4fv(slot->model_loc, 1, GL_FALSE, &p.model[0][0]);
+        glUniformMatrix3fv(slot->normal_matrix_loc, 1, GL_FALSE, &p.normal[0].x);
+        glUniform3fv(slot->color_loc, 1, &p.color[0]);
+        geometry_arena().draw(p.geometry);
+      }
+      ++stats.draws;
+    }
+    glBindVertexArray(0);
+    packets.clear();
+    ++stats.frames;
+  }
+
+  void report(FILE *out = stdout) const {
+    double frames = (stats.frames ? (double)stats.frames : 1.0);
+    fprintf(out, "render queue: %lu frames, %.1f draws, %.1f program switches, %.1f vao binds per frame\n",
+      stats.frames, (stats.draws / frames), (stats.program_switches / frames), (stats.vao_binds / frames));
+  }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+/* clang-format off */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "def.h"
+
+/* On-disk cache of linked shader programs, so a launch with unchanged shaders skips compiling and linking.
+ * Programs are stored with `glGetProgramBinary()` under `dir`, one file per program, keyed by a hash of
+ * the final source of every stage, the include list, and the vendor, renderer and version of the driver.
+ * A binary the driver no longer accepts, after a driver update for example, is compiled from source again
+ * and the entry replaced. */
+
+/* Bump when the file layout below changes, old entries then just miss. */
+#define SHADER_CACHE_VERSION 1
+#define SHADER_CACHE_MAGIC   0x48535047u
+
+/* One stage of a program after preprocessing, `files[n]` is the file `#line` directives call source `n`. */
+typedef struct {
+  Uint type;
+  std::string source;
+  std::vector<std::string> files;
+} ShaderStage;
+
+typedef struct {
+  Uint magic;
+  Uint version;
+  Ulong key;
+  Uint format;
+  Uint size;
+} ShaderCacheHeader;
+
+typedef struct {
+  /* Programs loaded from the cache, and compiled from source, `rejected` of those had an entry that was
+   * unreadable or that the driver refused. */
+  Uint hits;
+  Uint misses;
+  Uint rejected;
+  /* Time spent creating programs either way. */
+  double hit_ms;
+  double miss_ms;
+} ShaderCacheStats;
+
+class ShaderCache {
+ private:
+  std::string driver;
+  bool checked = false;
+  bool supported = false;
+
+  /* Binaries are only of use when the driver has at least one format for them. */
+  bool usable(void) {
+    if (!checked) {
+      checked = true;
+      int formats = 0;
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+      supported = (formats > 0);
+      const char *strings[3] = {
+        (const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER), (const char *)glGetString(GL_VERSION)
+      };
+      for (const char *s : strings) {
+        driver += (s ? s : "");
+        driver += '\n';
+      }
+    }
+    return (enabled && supported);
+  }
+
+  std::string path(Ulong key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016lx.bin", key);
+    return (dir + name);
+  }
+
+ public:
+  std::string dir = "shader_cache";
+  bool enabled = true;
+  ShaderCacheStats stats = {};
+
+  /* Fnv-1a over `driver`, the include list and every stage in order, type and source. */
+  Ulong key(const std::vector<ShaderStage> &stages, const MVector<const char *> &includes) {
+    usable();
+    Ulong hash = 14695981039346656037ull;
+    auto feed = [&](const void *data, Ulong size) {
+      for (Ulong i = 0; i < size; ++i) {
+        hash = ((hash ^ ((const Uchar *)data)[i]) * 1099511628211ull);
+      }
+    };
+    Uint version = SHADER_CACHE_VERSION;
+    feed(&version, sizeof(version));
+    feed(driver.data(), driver.size());
+    for (const char *inc : includes) {
+      feed(inc, (strlen(inc) + 1));
+    }
+    for (const auto &stage : stages) {
+      feed(&stage.type, sizeof(stage.type));
+      feed(stage.source.data(), (stage.source.size() + 1));
+    }
+    return hash;
+  }
+
+  /* Whether linked programs should be made retrievable, call before `glLinkProgram()`. */
+  bool wants_binary(void) {
+    return usable();
+  }
+
+  /* A program created from the entry for `key`, or 0 when there is none or the driver rejects it. */
+  Uint load(Ulong key) {
+    if (!usable()) {
+      return 0;
+    }
+    FILE *file = fopen(path(key).c_str(), "rb");
+    if (!file) {
+      return 0;
+    }
+    ShaderCacheHeader header;
+    MVector<Uchar> binary;
+    bool ok = (fread(&header, sizeof(header), 1, file) == 1 && header.magic == SHADER_CACHE_MAGIC &&
+               header.version == SHADER_CACHE_VERSION && header.key == key && header.size);
+    if (ok) {
+      binary.resize(header.size);
+      ok = (fread(binary.data(), 1, header.size, file) == header.size);
+    }
+    fclose(file);
+    if (!ok) {
+      ++stats.rejected;
+      return 0;
+    }
+    Uint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary.data(), header.size);
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+      glDeleteProgram(program);
+      ++stats.rejected;
+      return 0;
+    }
+    return program;
+  }
+
+  /* Write the binary of the linked `program` as the entry for `key`.  Failing to is not an error, the
+   * program is just compiled again next launch. */
+  void store(Ulong key, Uint program) {
+    if (!usable()) {
+      return;
+    }
+    int size = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0) {
+      return;
+    }
+    MVector<Uchar> binary;
+    binary.resize(size);
+    ShaderCacheHeader header = {SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION, key, 0, 0};
+    int length = 0;
+    glGetProgramBinary(program, size, &length, &header.format, binary.data());
+    if (length <= 0) {
+      return;
+    }
+    header.size = (Uint)length;
+    mkdir(dir.c_str(), 0755);
+    /* Written to a temporary first, so a crash never leaves a torn entry behind. */
+    std::string final_path = path(key);
+    std::string temp_path  = (final_path + ".tmp");
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+      return;
+    }
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, header.size, file) == header.size);
+    ok = ((fclose(file) == 0) && ok);
+    if (!ok || rename(temp_path.c_str(), final_path.c_str()) != 0) {
+      remove(temp_path.c_str());
+    }
+  }
+
+  void report(FILE *out = stdout) const {
+    fprintf(out, "shader cache: %u programs loaded in %.2f ms, %u compiled in %.2f ms (%u rejected entries)\n",
+      stats.hits, stats.hit_ms, stats.misses, stats.miss_ms, stats.rejected);
+  }
+};
+
+inline ShaderCache &shader_cache(void) {
+  static ShaderCache cache;
+  return cache;
+}
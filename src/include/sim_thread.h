@@ -0,0 +1,189 @@
+#pragma once
+
+/* clang-format off */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "cpu_compute.h"
+
+/* Fixed-timestep simulation, decoupled from the render rate.  Simulation always advances in steps of
+ * `SIM_DT_S`, however long a frame takes, and the renderer interpolates between the last two states. */
+
+/* Max steps run to catch up in one go, so a long stall drops time instead of spiraling. */
+#define SIM_MAX_SUBSTEPS 8
+
+/* Accumulates real time, and hands it out as whole simulation steps. */
+class FixedStep {
+ private:
+  double dt;
+  double accumulator = 0.0;
+
+ public:
+  FixedStep(double dt = SIM_DT_S) : dt(dt) {}
+
+  /* Add `elapsed_s` of real time, returns the number of steps to run now. */
+  Uint advance(double elapsed_s) {
+    accumulator += elapsed_s;
+    Uint steps = (Uint)(accumulator / dt);
+    accumulator -= (steps * dt);
+    if (steps > SIM_MAX_SUBSTEPS) {
+      steps = SIM_MAX_SUBSTEPS;
+      accumulator = 0.0;
+    }
+    return steps;
+  }
+
+  /* How far real time is into the next step, in [0, 1). */
+  float alpha(void) const {
+    return (float)(accumulator / dt);
+  }
+
+  /* Real time left until the next step is due. */
+  double remaining_s(void) const {
+    return (dt - accumulator);
+  }
+};
+
+/* Lock-free single producer, single consumer triple buffer.  The writer fills `back()` and publishes it,
+ * the reader picks up the newest published slot with `update()`, and neither ever waits on the other. */
+template <typename T>
+class TripleBuffer {
+ private:
+  static constexpr Uint DIRTY = 4;
+  T slots[3];
+  /* Index of the shared middle slot, with `DIRTY` set when it holds a state the reader has not seen yet. */
+  std::atomic<Uint> middle{1};
+  /* Owned by the writer. */
+  Uint back_idx = 0;
+  /* Owned by the reader. */
+  Uint front_idx = 2;
+
+ public:
+  T &slot(Uint i) {
+    return slots[i];
+  }
+
+  T &back(void) {
+    return slots[back_idx];
+  }
+
+  void publish(void) {
+    back_idx = (middle.exchange((back_idx | DIRTY), std::memory_order_acq_rel) & 3);
+  }
+
+  /* Returns true when a newer state was swapped in to `front()`. */
+  bool update(void) {
+    if (!(middle.load(std::memory_order_relaxed) & DIRTY)) {
+      return false;
+    }
+    front_idx = (middle.exchange(front_idx, std::memory_order_acq_rel) & 3);
+    return true;
+  }
+
+  const T &front(void) const {
+    return slots[front_idx];
+  }
+};
+
+typedef struct {
+  /* State before and after the newest step. */
+  MVector<ComputeData> prev;
+  MVector<ComputeData> curr;
+  /* Total steps taken, and the real time the newest of them was due. */
+  Ulong step;
+  std::chrono::steady_clock::time_point due;
+} SimSnapshot;
+
+/* Interpolate the positions of `prev` and `curr` into `out`, everything but the position is taken from `curr`. */
+inline void interpolate_bodies(const MVector<ComputeData> &prev, const MVector<ComputeData> &curr, float t, MVector<ComputeData> *out) {
+  out->resize(curr.size());
+  for (Uint i = 0; i < curr.size(); ++i) {
+    (*out)[i] = curr[i];
+    if (i < prev.size()) {
+      (*out)[i].pos = (prev[i].pos + ((curr[i].pos - prev[i].pos) * t));
+    }
+  }
+}
+
+/* Runs the cpu backend on its own thread at a fixed rate, publishing every new state to the renderer. */
+class SimThread {
+ private:
+  CpuComputeObject *compute = nullptr;
+  TripleBuffer<SimSnapshot> buffer;
+  std::thread thread;
+  std::atomic<bool> running{false};
+
+  void run(void) {
+    using std::chrono::steady_clock;
+    FixedStep fixed;
+    MVector<ComputeData> prev = compute->data;
+    Ulong step = 0;
+    steady_clock::time_point last = steady_clock::now();
+    while (running.load(std::memory_order_relaxed)) {
+      steady_clock::time_point now = steady_clock::now();
+      Uint steps = fixed.advance(std::chrono::duration<double>(now - last).count());
+      last = now;
+      for (Uint i = 0; i < steps; ++i) {
+        if (i == (steps - 1)) {
+          compute->readback();
+          prev = compute->data;
+        }
+        compute->perform(FUSED_OPERATION);
+        ++step;
+      }
+      if (steps) {
+        compute->readback();
+        SimSnapshot &back = buffer.back();
+        back.prev = prev;
+        back.curr = compute->data;
+        back.step = step;
+        back.due  = (now - std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(fixed.alpha() * SIM_DT_S)));
+        buffer.publish();
+      }
+      std::this_thread::sleep_for(std::chrono::duration<double>(fixed.remaining_s()));
+    }
+  }
+
+ public:
+  ~SimThread(void) {
+    stop();
+  }
+
+  /* Start stepping `compute`, which must not be touched by any other thread until `stop()`. */
+  void start(CpuComputeObject *compute) {
+    this->compute = compute;
+    compute->readback();
+    for (Uint i = 0; i < 3; ++i) {
+      SimSnapshot &s = buffer.slot(i);
+      s.prev = compute->data;
+      s.curr = compute->data;
+      s.step = 0;
+      s.due  = std::chrono::steady_clock::now();
+    }
+    running.store(true);
+    thread = std::thread(&SimThread::run, this);
+  }
+
+  void stop(void) {
+    if (running.exchange(false)) {
+      thread.join();
+    }
+  }
+
+  /* Newest published state, stays valid until the next call. */
+  const SimSnapshot &latest(void) {
+    buffer.update();
+    return buffer.front();
+  }
+
+  /* Interpolated body state for rendering right now. */
+  void interpolate(MVector<ComputeData> *out) {
+    const SimSnapshot &s = latest();
+    std::chrono::duration<double> since = (std::chrono::steady_clock::now() - s.due);
+    float t = std::min(std::max((float)(since.count() / SIM_DT_S), 0.0f), 1.0f);
+    interpolate_bodies(s.prev, s.curr, t, out);
+  }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+/* clang-format off */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <Mlib/Vector.h>
+
+/* Work-stealing thread pool used by the cpu physics path.  `parallel_for()` splits a range into chunks
+ * and deals them out round-robin to per-thread deques.  Each thread pops from the back of its own
+ * deque, and when it runs dry steals from the front of the others.  The calling thread takes part as
+ * worker 0, so a pool of one thread runs everything inline. */
+class ThreadPool {
+ private:
+  typedef struct {
+    Uint begin;
+    Uint end;
+  } Chunk;
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Chunk> chunks;
+    std::thread thread;
+    /* Stats, only written by the owning thread. */
+    double busy_ms = 0.0;
+    Ulong chunks_run = 0;
+    Ulong steals = 0;
+  };
+
+  Uint count;
+  std::unique_ptr<Worker[]> workers;
+  std::function<void(Uint, Uint)> job;
+  std::atomic<Uint> remaining;
+  bool stop = false;
+  Ulong generation = 0;
+  std::mutex wake_mutex;
+  std::condition_variable wake_cv;
+
+  bool pop(Uint self, Chunk *chunk) {
+    {
+      Worker &w = workers[self];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      if (!w.chunks.empty()) {
+        *chunk = w.chunks.back();
+        w.chunks.pop_back();
+        return true;
+      }
+    }
+    for (Uint i = 1; i < count; ++i) {
+      Worker &victim = workers[(self + i) % count];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.chunks.empty()) {
+        *chunk = victim.chunks.front();
+        victim.chunks.pop_front();
+        ++workers[self].steals;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run_chunks(Uint self) {
+    Chunk chunk;
+    while (pop(self, &chunk)) {
+      auto start = std::chrono::high_resolution_clock::now();
+      job(chunk.begin, chunk.end);
+      std::chrono::duration<double, std::milli> took = (std::chrono::high_resolution_clock::now() - start);
+      workers[self].busy_ms += took.count();
+      ++workers[self].chunks_run;
+      remaining.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  void worker_loop(Uint self) {
+    Ulong seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake_cv.wait(lock, [&] { return (stop || generation != seen); });
+        if (stop) {
+          return;
+        }
+        seen = generation;
+      }
+      run_chunks(self);
+    }
+  }
+
+ public:
+  /* `thread_count` includes the calling thread, 0 means one thread per hardware thread. */
+  ThreadPool(Uint thread_count = 0) {
+    count = (thread_count ? thread_count : std::thread::hardware_concurrency());
+    if (!count) {
+      count = 1;
+    }
+    workers.reset(new Worker[count]);
+    remaining.store(0);
+    for (Uint i = 1; i < count; ++i) {
+      workers[i].thread = std::thread(&ThreadPool::worker_loop, this, i);
+    }
+  }
+
+  ~ThreadPool(void) {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      stop = true;
+    }
+    wake_cv.notify_all();
+    for (Uint i = 1; i < count; ++i) {
+      workers[i].thread.join();
+    }
+  }
+
+  Uint size(void) const {
+    return count;
+  }
+
+  /* Run `fn(begin, end)` over [0, n) in chunks of `chunk_size`, and return once every chunk has run. */
+  void parallel_for(Uint n, Uint chunk_size, const std::function<void(Uint, Uint)> &fn) {
+    if (!n) {
+      return;
+    }
+    if (!chunk_size) {
+      chunk_size = 1;
+    }
+    job = fn;
+    Uint chunk_count = ((n + chunk_size - 1) / chunk_size);
+    remaining.store(chunk_count, std::memory_order_relaxed);
+    for (Uint c = 0; c < chunk_count; ++c) {
+      Worker &w = workers[c % count];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.chunks.push_back({(c * chunk_size), std::min(((c + 1) * chunk_size), n)});
+    }
+    if (count > 1) {
+      {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        ++generation;
+      }
+      wake_cv.notify_all();
+    }
+    run_chunks(0);
+    /* Other threads may still be finishing stolen chunks. */
+    while (remaining.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+
+  /* Chunk size for `n` items, giving every thread several chunks to balance with, rounded to a multiple of `align`. */
+  Uint chunk_size(Uint n, Uint align = 1) const {
+    Uint size = std::max((n / (count * 8)), 1u);
+    return (((size + align - 1) / align) * align);
+  }
+
+  /* Print busy time, chunks and steals per thread since the last `reset_stats()`. */
+  void report(FILE *out = stdout) const {
+    for (Uint i = 0; i < count; ++i) {
+      fprintf(out, "thread %u: busy %.3f ms, chunks %lu, steals %lu\n", i, workers[i].busy_ms, workers[i].chunks_run, workers[i].steals);
+    }
+  }
+
+  void reset_stats(void) {
+    for (Uint i = 0; i < count; ++i) {
+      workers[i].busy_ms    = 0.0;
+      workers[i].chunks_run = 0;
+      workers[i].steals     = 0;
+    }
+  }
+};
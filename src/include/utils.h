@@ -92,22 +92,92 @@ __INLINE_CONSTEXPR(vec3) mat_position_vec(const mat4 &mat) {
   return vec3(mat[3].x ,mat[3].y, mat[3].z);
 }
 
+/* Rotation of `degrees` around x, then y, then z. */
+inline mat4 rotation_matrix(const vec3 &degrees) {
+  float cx = cosf(radiansf(degrees.x)), sx = sinf(radiansf(degrees.x));
+  float cy = cosf(radiansf(degrees.y)), sy = sinf(radiansf(degrees.y));
+  float cz = cosf(radiansf(degrees.z)), sz = sinf(radiansf(degrees.z));
+  mat4 r(1.0f);
+  r[0] = vec4((cy * cz), (cy * sz), -sy, 0.0f);
+  r[1] = vec4(((sx * sy * cz) - (cx * sz)), ((sx * sy * sz) + (cx * cz)), (sx * cy), 0.0f);
+  r[2] = vec4(((cx * sy * cz) + (sx * sz)), ((cx * sy * sz) - (sx * cz)), (cx * cy), 0.0f);
+  return r;
+}
+
+/* Inverse transpose of the upper 3x3 of `model`, as three columns, what normals have to be transformed by.
+ * With columns `a`, `b` and `c` that is `(b x c, c x a, a x b) / det`, no general inverse needed. */
+inline void normal_matrix(const mat4 &model, vec3 *columns) {
+  vec3 a(model[0].x, model[0].y, model[0].z);
+  vec3 b(model[1].x, model[1].y, model[1].z);
+  vec3 c(model[2].x, model[2].y, model[2].z);
+  auto cross3 = [](const vec3 &u, const vec3 &v) {
+    return vec3(((u.y * v.z) - (u.z * v.y)), ((u.z * v.x) - (u.x * v.z)), ((u.x * v.y) - (u.y * v.x)));
+  };
+  vec3 bc = cross3(b, c);
+  float inv_det = (1.0f / ((a.x * bc.x) + (a.y * bc.y) + (a.z * bc.z)));
+  columns[0] = (bc * inv_det);
+  columns[1] = (cross3(c, a) * inv_det);
+  columns[2] = (cross3(a, b) * inv_det);
+}
+
+/* Scale, then rotate by `rotation` degrees, then translate to `pos`, and the columns of the normal matrix of
+ * that in `normal`.  `Mesh` and `InstancedMesh` both build their matrices here, so a body looks the same
+ * whichever of the two draws it. */
+inline mat4 model_matrix(const vec3 &pos, const vec3 &rotation, const vec3 &scale, vec3 *normal) {
+  mat4 model = (translate_matrix(mat4(1.0f), pos) * rotation_matrix(rotation) * scale_matrix(mat4(1.0f), scale));
+  normal_matrix(model, normal);
+  return model;
+}
+
+/* The six planes of the view frustum of `view_projection`, left, right, bottom, top, near and far.  Each
+ * is `(normal, d)` with the normal pointing inward and normalized, so `dot(normal, p) + d` is the signed
+ * distance of `p` from the plane. */
+inline void frustum_planes(const mat4 &view_projection, vec4 *planes) {
+  const mat4 &m = view_projection;
+  for (Uint i = 0; i < 3; ++i) {
+    for (Uint side = 0; side < 2; ++side) {
+      float sign = (side ? -1.0f : 1.0f);
+      float p[4];
+      for (Uint c = 0; c < 4; ++c) {
+        p[c] = (m[c][3] + (sign * m[c][i]));
+      }
+      float len = length(vec3(p[0], p[1], p[2]));
+      planes[(i * 2) + side] = vec4((p[0] / len), (p[1] / len), (p[2] / len), (p[3] / len));
+    }
+  }
+}
+
 __INLINE_CONSTEXPR_VOID set_sun_light(GameObject *game, const vec3 &direction, const vec3 &color, float strength) {
   game->sun.direction = direction;
   game->sun.color = color;
   game->sun.strength = strength;
 }
 
-__INLINE_CONSTEXPR_VOID set_sun_direction(GameObject *game, const vec3 &end_pos) {
-  vec3 dir = direction_vec(end_pos, game->sun.pos);
-  game->sun.direction = dir;
+/* Write the camera and the sun into the frame uniform buffer, call once per frame after the camera moved
+ * and before anything is drawn.  The sun direction is worked out per vertex from `sun.pos`. */
+inline void update_frame_uniforms(GameObject *game) {
+  FrameUniforms &f = game->frame.data;
+  f.view          = game->camera.view;
+  f.projection    = game->projection;
+  f.view_position = vec4(game->camera.pos.x, game->camera.pos.y, game->camera.pos.z, 0.0f);
+  f.sun_pos       = vec4(game->sun.pos.x, game->sun.pos.y, game->sun.pos.z, 0.0f);
+  f.sun_color     = vec4(game->sun.color.x, game->sun.color.y, game->sun.color.z, game->sun.strength);
+  game->frame.upload();
+}
+
+/* Body state of whichever physics backend was selected at startup. */
+inline MVector<ComputeData> &physics_data(GameObject *game) {
+  return (game->cpu_physics ? game->cpu_compute.data : game->compute.data);
+}
+
+inline void physics_upload(GameObject *game) {
+  game->cpu_physics ? game->cpu_compute.upload() : game->compute.upload();
+}
+
+inline void physics_readback(GameObject *game) {
+  game->cpu_physics ? game->cpu_compute.readback() : game->compute.readback();
 }
 
-inline void set_sun_light_uniforms(GameObject *game) {
-  glUseProgram(game->shader_program);
-  glUniform3fv(glGetUniformLocation(game->shader_program, "view_position"), 1, &game->camera.pos[0]);
-  glUniform3fv(glGetUniformLocation(game->shader_program, "sun_direction"), 1, &game->sun.pos[0]);
-  glUniform3fv(glGetUniformLocation(game->shader_program, "sun_direction"), 1, &game->sun.direction[0]);
-  glUniform3fv(glGetUniformLocation(game->shader_program, "sun_color"), 1, &game->sun.color[0]);
-  glUniform1f(glGetUniformLocation(game->shader_program, "sun_strength"), game->sun.strength);
+inline void physics_perform(GameObject *game, Uint operation) {
+  game->cpu_physics ? game->cpu_compute.perform(operation) : game->compute.perform(operation);
 }
\ No newline at end of file
@@ -0,0 +1,33 @@
+#version 450 core
+
+/* Draws the physics bodies straight from the body buffers of shader.comp, so their state never goes
+ * through the cpu on the way to the screen.  Which body an instance is comes from the visible list the
+ * cull pass wrote, see indirect.h.  The body structs, buffers and `load_state()` are generated from
+ * body_layout.h by `create_body_shader_program()`. */
+
+layout(location = 0) in vec3 aPos;    /* Vertex position. */
+layout(location = 1) in vec3 aNormal; /* Vertex normal. */
+/* Per instance, offset by the base instance of each indirect command. */
+layout(location = 10) in uint body_index;
+
+out vec3 FragPos;      /* Position of the fragment. */
+out vec3 Normal;       /* Normal of the fragment. */
+out vec3 Color;        /* Base color of the body. */
+out vec3 SunDirection; /* Direction of the sun light hitting the body. */
+
+#include "frame_uniforms.glsl"
+
+#include "body_draw.glsl"
+layout(std430, binding = 21) readonly buffer BodyDrawBuffer { BodyDraw body_draw[]; };
+
+void main() {
+  vec3 pos = load_state(body_index).pos_radius.xyz;
+  BodyDraw d = body_draw[body_index];
+  /* Scale then translate, the same model matrix `InstancedMesh::set()` builds. */
+  FragPos = ((aPos * d.scale.xyz) + pos);
+  /* The inverse transpose of a scale is the inverse scale. */
+  Normal = normalize(aNormal / d.scale.xyz);
+  gl_Position = projection * view * vec4(FragPos, 1.0);
+  Color = d.color.rgb;
+  SunDirection = normalize(pos - sun_pos.xyz);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+/* Draw scale of every body, with its bounding radius in w, and its color.  Must match `BodyDraw` in indirect.h. */
+struct BodyDraw {
+  vec4 scale;
+  vec4 color;
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+/* Written once per frame, see `FrameUniforms` in frame_uniforms.h. */
+layout(std140, binding = 0) uniform FrameUniforms {
+  mat4 view;
+  mat4 projection;
+  vec4 view_position;
+  vec4 sun_pos;
+  vec4 sun_color; /* Strength in w. */
+};
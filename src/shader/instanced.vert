@@ -0,0 +1,29 @@
+#version 450 core
+
+/* Instanced variant of shader.vert, every instance brings its own model matrix and color, and the sun
+ * direction is worked out per instance the same way shader.vert does it per mesh. */
+
+layout(location = 0) in vec3 aPos;    /* Vertex position. */
+layout(location = 1) in vec3 aNormal; /* Vertex normal. */
+/* Per instance, see `InstanceData` in instancing.h. */
+layout(location = 2) in mat4 instance_model;
+layout(location = 6) in vec4 instance_color;
+layout(location = 7) in mat3 instance_normal; /* Inverse transpose of `instance_model`. */
+
+out vec3 FragPos;      /* Position of the fragment. */
+out vec3 Normal;       /* Normal of the fragment. */
+out vec3 Color;        /* Base color of the instance. */
+out vec3 SunDirection; /* Direction of the sun light hitting the instance. */
+
+#include "frame_uniforms.glsl"
+
+void main() {
+  /* Calculate the vertex position in world space. */
+  FragPos = vec3(instance_model * vec4(aPos, 1.0));
+  /* Transform the normal vector by the invers transpose of the model matrix, worked out on the cpu. */
+  Normal = normalize(instance_normal * aNormal);
+  /* Calculate the final position. */
+  gl_Position = projection * view * vec4(FragPos, 1.0);
+  Color = instance_color.rgb;
+  SunDirection = normalize(instance_model[3].xyz - sun_pos.xyz);
+}
@@ -0,0 +1,15 @@
+#version 450 core
+
+in vec2 Corner;
+in vec4 Color;
+
+out vec4 FragColor;
+
+void main() {
+  /* Round particles, soft towards the edge. */
+  float d = dot(Corner, Corner);
+  if (d > 1.0) {
+    discard;
+  }
+  FragColor = vec4(Color.rgb, (Color.a * (1.0 - d)));
+}
@@ -0,0 +1,35 @@
+#version 450 core
+
+/* Draws every particle straight from the compute shader's particle buffer, one instanced quad per
+ * particle facing the camera.  Dead particles collapse to a degenerate quad. */
+
+/* Must match `Particle` in compute.h. */
+struct Particle {
+  vec4 pos_life;
+  vec4 vel_size;
+  vec4 color;
+};
+
+layout(std430, binding = 0) readonly buffer ParticleBuffer { Particle particles[]; };
+
+out vec2 Corner; /* Position in the quad, [-1, 1]. */
+out vec4 Color;
+
+#include "frame_uniforms.glsl"
+
+void main() {
+  Particle p = particles[gl_InstanceID];
+  if (p.pos_life.w <= 0.0) {
+    gl_Position = vec4(0.0);
+    return;
+  }
+  /* Triangle strip corners from the vertex id, (-1, -1), (1, -1), (-1, 1), (1, 1). */
+  Corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1)) * 2.0 - 1.0;
+  /* Camera right and up are the first two rows of the view matrix. */
+  vec3 right = vec3(view[0][0], view[1][0], view[2][0]);
+  vec3 up    = vec3(view[0][1], view[1][1], view[2][1]);
+  vec3 pos   = (p.pos_life.xyz + (((right * Corner.x) + (up * Corner.y)) * (p.vel_size.w * 0.5)));
+  /* Fade out over the last second of life. */
+  Color = vec4(p.color.rgb, (p.color.a * min(p.pos_life.w, 1.0)));
+  gl_Position = projection * view * vec4(pos, 1.0);
+}